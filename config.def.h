@@ -5,8 +5,12 @@ static char *fontfallbacks[] = {
 	"roboto",
 	"ubuntu",
 };
-#define NUMFONTSCALES 42
-#define FONTSZ(x) ((int)(10.0 * powf(1.1288, (x)))) /* x in [0, NUMFONTSCALES-1] */
+/* text is measured once at the reference size and then sized to fit the
+ * window between the smallest and the largest size, all in points */
+static const float reffontsize = 48;
+static const float minfontsize = 10;
+static const float maxfontsize = 1400;
+#define NUMFONTSIZES 8 /* font sizes kept open */
 
 static const char *colors[] = {
 	"#000000", /* foreground color */
@@ -19,6 +23,34 @@ static const float linespacing = 1.4;
 static const float usablewidth = 0.75;
 static const float usableheight = 0.75;
 
+/* resampling filters for shrinking and enlarging images: ScaleNearest,
+ * ScaleBox, ScaleBicubic or ScaleLanczos */
+static const int downscalefilter = ScaleBox;
+static const int upscalefilter = ScaleBicubic;
+
+/* let the X server scale images with XRender instead of scaling them here
+ * and sending every scaled copy, worthwhile for remote displays */
+static const int serverscale = 0;
+
+/* while resizing, images are only scaled with nearest neighbour until the
+ * window size has not changed for this many milliseconds */
+static const long resizeidle = 150;
+
+/* threads sharing the work of scaling an image, 0 for one per CPU */
+static const unsigned int scalethreads = 0;
+
+/* memory limit for scaled images and rendered text kept around for
+ * revisiting slides, and with serverscale the unscaled images, in bytes */
+static const size_t scachesize = 64 * 1024 * 1024;
+
+/* slides scaled or rendered ahead of time while idle, relative to the
+ * current one */
+static const int predraw[] = { 1, -1 };
+
+/* text slides laid out ahead of time while idle once the above are done,
+ * which loads their glyphs at the size they are drawn at */
+static const int preload[] = { 2, 3 };
+
 static Mousekey mshortcuts[] = {
 	/* button         function        argument */
 	{ Button1,        advance,        {.i = +1} },
@@ -4,60 +4,175 @@
 #include <string.h>
 #include <X11/Xlib.h>
 #include <X11/Xft/Xft.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 #include "drw.h"
+#include "measure.h"
 #include "util.h"
 
 #define UTF_INVALID 0xFFFD
-#define UTF_SIZ     4
 
-static const unsigned char utfbyte[UTF_SIZ + 1] = {0x80,    0, 0xC0, 0xE0, 0xF0};
-static const unsigned char utfmask[UTF_SIZ + 1] = {0xC0, 0x80, 0xE0, 0xF0, 0xF8};
-static const long utfmin[UTF_SIZ + 1] = {       0,    0,  0x80,  0x800,  0x10000};
-static const long utfmax[UTF_SIZ + 1] = {0x10FFFF, 0x7F, 0x7FF, 0xFFFF, 0x10FFFF};
+/* font indices kept in Drw.coverage */
+#define NOFONT      -1
+#define FALLBACK(i) (-2 - (int)(i)) /* Drw.fallbacks[i], its own inverse */
 
-static long
-utf8decodebyte(const char c, size_t *i)
+/* open addressed hash map from codepoints to font indices */
+struct Fntcache {
+	long *cp; /* -1 in free slots */
+	int *idx;
+	size_t size, len;
+};
+
+/* Decode the UTF-8 sequence at c, which ends at a NUL byte at the latest.
+ * Invalid input decodes to UTF_INVALID one maximal subpart at a time, the
+ * way Unicode recommends. Returns the number of bytes used. */
+static size_t
+utf8decode(const unsigned char *c, long *u)
 {
-	for (*i = 0; *i < (UTF_SIZ + 1); ++(*i))
-		if (((unsigned char)c & utfmask[*i]) == utfbyte[*i])
-			return (unsigned char)c & ~utfmask[*i];
-	return 0;
+	unsigned char lo = 0x80, hi = 0xBF;
+	size_t i, len;
+
+	*u = UTF_INVALID;
+	if (c[0] < 0x80) {
+		*u = c[0];
+		return 1;
+	} else if (c[0] < 0xC2) {
+		/* stray continuation byte or overlong lead byte */
+		return 1;
+	} else if (c[0] < 0xE0) {
+		len = 2;
+		*u = c[0] & 0x1F;
+	} else if (c[0] < 0xF0) {
+		len = 3;
+		*u = c[0] & 0x0F;
+		/* neither overlong nor a surrogate */
+		lo = c[0] == 0xE0 ? 0xA0 : 0x80;
+		hi = c[0] == 0xED ? 0x9F : 0xBF;
+	} else if (c[0] < 0xF5) {
+		len = 4;
+		*u = c[0] & 0x07;
+		/* neither overlong nor above U+10FFFF */
+		lo = c[0] == 0xF0 ? 0x90 : 0x80;
+		hi = c[0] == 0xF4 ? 0x8F : 0xBF;
+	} else {
+		return 1;
+	}
+	for (i = 1; i < len; i++, lo = 0x80, hi = 0xBF) {
+		if (!BETWEEN(c[i], lo, hi)) {
+			*u = UTF_INVALID;
+			return i;
+		}
+		*u = (*u << 6) | (c[i] & 0x3F);
+	}
+	return len;
 }
 
+/* Copy the ASCII bytes at the start of the n bytes at c into u, widened
+ * to codepoints. Returns how many there were. */
 static size_t
-utf8validate(long *u, size_t i)
+asciidecode(const unsigned char *c, size_t n, FcChar32 *u)
 {
-	if (!BETWEEN(*u, utfmin[i], utfmax[i]) || BETWEEN(*u, 0xD800, 0xDFFF))
-		*u = UTF_INVALID;
-	for (i = 1; *u > utfmax[i]; ++i)
-		;
+	size_t i = 0;
+#ifdef __SSE2__
+	__m128i v, lo, hi, zero = _mm_setzero_si128();
+
+	for (; i + 16 <= n; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)&c[i]);
+		if (_mm_movemask_epi8(v))
+			break;
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *)&u[i], _mm_unpacklo_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)&u[i + 4], _mm_unpackhi_epi16(lo, zero));
+		_mm_storeu_si128((__m128i *)&u[i + 8], _mm_unpacklo_epi16(hi, zero));
+		_mm_storeu_si128((__m128i *)&u[i + 12], _mm_unpackhi_epi16(hi, zero));
+	}
+#endif
+	for (; i < n && c[i] < 0x80; i++)
+		u[i] = c[i];
 	return i;
 }
 
 static size_t
-utf8decode(const char *c, long *u, size_t clen)
+fntcacheslot(struct Fntcache *c, long u)
 {
-	size_t i, j, len, type;
-	long udecoded;
+	size_t i;
 
-	*u = UTF_INVALID;
-	if (!clen)
-		return 0;
-	udecoded = utf8decodebyte(c[0], &len);
-	if (!BETWEEN(len, 1, UTF_SIZ))
-		return 1;
-	for (i = 1, j = 1; i < clen && j < len; ++i, ++j) {
-		udecoded = (udecoded << 6) | utf8decodebyte(c[i], &type);
-		if (type)
-			return j;
+	for (i = (unsigned long)u * 2654435761UL & (c->size - 1);
+	     c->cp[i] != -1 && c->cp[i] != u; i = (i + 1) & (c->size - 1))
+		;
+	return i;
+}
+
+static void
+fntcacheresize(struct Fntcache *c, size_t size)
+{
+	long *oldcp = c->cp;
+	int *oldidx = c->idx;
+	size_t i, j, oldsize = c->size;
+
+	c->size = size;
+	c->cp = ecalloc(size, sizeof(*c->cp));
+	c->idx = ecalloc(size, sizeof(*c->idx));
+	memset(c->cp, -1, size * sizeof(*c->cp));
+	for (i = 0; i < oldsize; i++) {
+		if (oldcp[i] != -1) {
+			j = fntcacheslot(c, oldcp[i]);
+			c->cp[j] = oldcp[i];
+			c->idx[j] = oldidx[i];
+		}
 	}
-	if (j < len)
+	free(oldcp);
+	free(oldidx);
+}
+
+static struct Fntcache *
+fntcachecreate(void)
+{
+	struct Fntcache *c = ecalloc(1, sizeof(*c));
+
+	fntcacheresize(c, 256);
+	return c;
+}
+
+static void
+fntcachefree(struct Fntcache *c)
+{
+	if (!c)
+		return;
+	free(c->cp);
+	free(c->idx);
+	free(c);
+}
+
+/* Look up codepoint u, returns 0 if it is not in the map. */
+static int
+fntcacheget(struct Fntcache *c, long u, int *idx)
+{
+	size_t i = fntcacheslot(c, u);
+
+	if (c->cp[i] != u)
 		return 0;
-	*u = udecoded;
-	utf8validate(u, len);
+	*idx = c->idx[i];
+	return 1;
+}
 
-	return len;
+static void
+fntcacheput(struct Fntcache *c, long u, int idx)
+{
+	size_t i = fntcacheslot(c, u);
+
+	if (c->cp[i] != u) {
+		c->cp[i] = u;
+		/* keep at least half of the slots free */
+		if (2 * ++c->len > c->size) {
+			fntcacheresize(c, 2 * c->size);
+			i = fntcacheslot(c, u);
+		}
+	}
+	c->idx[i] = idx;
 }
 
 Drw *
@@ -73,6 +188,9 @@ drw_create(Display *dpy, int screen, Window root, unsigned int w, unsigned int h
 	drw->drawable = XCreatePixmap(dpy, root, w, h, DefaultDepth(dpy, screen));
 	drw->gc = XCreateGC(dpy, root, 0, NULL);
 	XSetLineAttributes(dpy, drw->gc, 1, LineSolid, CapButt, JoinMiter);
+	drw->xftdraw = XftDrawCreate(dpy, drw->drawable, DefaultVisual(dpy, screen),
+	                             DefaultColormap(dpy, screen));
+	drw->coverage = fntcachecreate();
 
 	return drw;
 }
@@ -88,13 +206,23 @@ drw_resize(Drw *drw, unsigned int w, unsigned int h)
 	if (drw->drawable)
 		XFreePixmap(drw->dpy, drw->drawable);
 	drw->drawable = XCreatePixmap(drw->dpy, drw->root, w, h, DefaultDepth(drw->dpy, drw->screen));
+	XftDrawChange(drw->xftdraw, drw->drawable);
 }
 
 void
 drw_free(Drw *drw)
 {
+	size_t i;
+
+	XftDrawDestroy(drw->xftdraw);
 	XFreePixmap(drw->dpy, drw->drawable);
 	XFreeGC(drw->dpy, drw->gc);
+	free(drw->glyphs);
+	free(drw->glyphx);
+	for (i = 0; i < drw->fallbackcount; i++)
+		FcPatternDestroy(drw->fallbacks[i]);
+	free(drw->fallbacks);
+	fntcachefree(drw->coverage);
 	free(drw);
 }
 
@@ -144,14 +272,180 @@ xfont_create(Drw *drw, const char *fontname, FcPattern *fontpattern)
 static void
 xfont_free(Fnt *font)
 {
+	size_t i;
+
 	if (!font)
 		return;
 	if (font->pattern)
 		FcPatternDestroy(font->pattern);
+	for (i = 0; i < font->fallbackcount; i++)
+		xfont_free(font->fallbacks[i]);
+	free(font->fallbacks);
 	XftFontClose(font->dpy, font->xfont);
 	free(font);
 }
 
+/* Open font at another size. Scalable fonts reuse their fontconfig match
+ * with the pixel size changed, anything else is matched again. */
+static Fnt *
+xfont_scale(Drw *drw, Fnt *font, double size)
+{
+	Fnt *ret;
+	XftFont *xfont = NULL;
+	FcPattern *pattern, *match;
+	FcBool scalable;
+	double oldsize, pixelsize;
+	XftResult result;
+
+	pattern = FcPatternDuplicate(font->pattern);
+	FcPatternDel(pattern, FC_SIZE);
+	FcPatternDel(pattern, FC_PIXEL_SIZE);
+	FcPatternAddDouble(pattern, FC_SIZE, size);
+
+	if (FcPatternGetBool(font->xfont->pattern, FC_SCALABLE, 0, &scalable) == FcResultMatch && scalable &&
+	    FcPatternGetDouble(font->xfont->pattern, FC_SIZE, 0, &oldsize) == FcResultMatch &&
+	    FcPatternGetDouble(font->xfont->pattern, FC_PIXEL_SIZE, 0, &pixelsize) == FcResultMatch &&
+	    oldsize > 0) {
+		match = FcPatternDuplicate(font->xfont->pattern);
+		FcPatternDel(match, FC_SIZE);
+		FcPatternDel(match, FC_PIXEL_SIZE);
+		FcPatternAddDouble(match, FC_SIZE, size);
+		FcPatternAddDouble(match, FC_PIXEL_SIZE, pixelsize * size / oldsize);
+	} else {
+		if (!(match = XftFontMatch(drw->dpy, drw->screen, pattern, &result)))
+			fprintf(stderr, "error, cannot match font at size %f.\n", size);
+	}
+	if (match && !(xfont = XftFontOpenPattern(drw->dpy, match))) {
+		fprintf(stderr, "error, cannot load font from pattern.\n");
+		FcPatternDestroy(match);
+	}
+	if (!xfont) {
+		FcPatternDestroy(pattern);
+		return NULL;
+	}
+
+	ret = ecalloc(1, sizeof(Fnt));
+	ret->xfont = xfont;
+	ret->pattern = pattern;
+	ret->h = xfont->ascent + xfont->descent;
+	ret->dpy = drw->dpy;
+
+	return ret;
+}
+
+/* Index of the first font able to draw codepoint u: one of the current
+ * set, a fallback font found before, or a newly matched fallback font. */
+static int
+fntcover(Drw *drw, long u)
+{
+	Fnt *font;
+	FcCharSet *fccharset;
+	FcPattern *fcpattern, *match;
+	XftResult result;
+	size_t i;
+
+	for (i = 0, font = drw->fonts; font; font = font->next, i++)
+		if (XftCharExists(drw->dpy, font->xfont, u))
+			return i;
+	for (i = 0; i < drw->fallbackcount; i++)
+		if (FcPatternGetCharSet(drw->fallbacks[i], FC_CHARSET, 0, &fccharset) == FcResultMatch &&
+		    FcCharSetHasChar(fccharset, u))
+			return FALLBACK(i);
+
+	if (!drw->fonts->pattern) {
+		/* Refer to the comment in xfont_create for more information. */
+		die("the first font in the cache must be loaded from a font string.");
+	}
+
+	fccharset = FcCharSetCreate();
+	FcCharSetAddChar(fccharset, u);
+
+	fcpattern = FcPatternDuplicate(drw->fonts->pattern);
+	FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
+	FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
+
+	FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
+	FcDefaultSubstitute(fcpattern);
+	match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
+
+	FcCharSetDestroy(fccharset);
+	FcPatternDestroy(fcpattern);
+
+	/* the closest match may still not have it */
+	if (!match)
+		return NOFONT;
+	if (FcPatternGetCharSet(match, FC_CHARSET, 0, &fccharset) != FcResultMatch ||
+	    !FcCharSetHasChar(fccharset, u)) {
+		FcPatternDestroy(match);
+		return NOFONT;
+	}
+
+	if (!(drw->fallbacks = realloc(drw->fallbacks, (drw->fallbackcount + 1) * sizeof(*drw->fallbacks))))
+		die("realloc:");
+	drw->fallbacks[drw->fallbackcount] = match;
+	return FALLBACK(drw->fallbackcount++);
+}
+
+/* Open fallback font i at the size of set, the first time it is needed. */
+static Fnt *
+xfont_fallback(Drw *drw, Fnt *set, size_t i)
+{
+	FcPattern *pattern;
+	double size;
+
+	if (i >= set->fallbackcount) {
+		if (!(set->fallbacks = realloc(set->fallbacks, (i + 1) * sizeof(*set->fallbacks))))
+			die("realloc:");
+		memset(&set->fallbacks[set->fallbackcount], 0,
+		       (i + 1 - set->fallbackcount) * sizeof(*set->fallbacks));
+		set->fallbackcount = i + 1;
+	}
+	if (set->fallbacks[i])
+		return set->fallbacks[i];
+
+	pattern = FcPatternDuplicate(drw->fallbacks[i]);
+	if (FcPatternGetDouble(set->xfont->pattern, FC_SIZE, 0, &size) == FcResultMatch) {
+		FcPatternDel(pattern, FC_SIZE);
+		FcPatternAddDouble(pattern, FC_SIZE, size);
+	}
+	if (FcPatternGetDouble(set->xfont->pattern, FC_PIXEL_SIZE, 0, &size) == FcResultMatch) {
+		FcPatternDel(pattern, FC_PIXEL_SIZE);
+		FcPatternAddDouble(pattern, FC_PIXEL_SIZE, size);
+	}
+	if (!(set->fallbacks[i] = xfont_create(drw, NULL, pattern)))
+		FcPatternDestroy(pattern);
+	return set->fallbacks[i];
+}
+
+/* Index of the font drawing codepoint u, the same for every size. */
+static int
+fntindex(Drw *drw, long u)
+{
+	int i;
+
+	if (!fntcacheget(drw->coverage, u, &i)) {
+		i = fntcover(drw, u);
+		fntcacheput(drw->coverage, u, i);
+	}
+	return i;
+}
+
+/* Font of the current set with index i. Codepoints no font has are drawn
+ * with the first one. */
+static Fnt *
+fntget(Drw *drw, int i)
+{
+	Fnt *font;
+
+	if (i == NOFONT)
+		return drw->fonts;
+	if (i < 0)
+		return (font = xfont_fallback(drw, drw->fonts, FALLBACK(i))) ? font : drw->fonts;
+	for (font = drw->fonts; i && font->next; i--)
+		font = font->next;
+	return font;
+}
+
 Fnt*
 drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 {
@@ -170,6 +464,26 @@ drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount)
 	return (drw->fonts = ret);
 }
 
+Fnt *
+drw_fontset_scale(Drw *drw, Fnt *set, double size)
+{
+	Fnt *cur, *ret = NULL, **last = &ret;
+
+	if (!drw)
+		return NULL;
+
+	/* fonts are known by their place in the set, so all have to open */
+	for (; set; set = set->next) {
+		if (!(cur = xfont_scale(drw, set, size))) {
+			drw_fontset_free(ret);
+			return NULL;
+		}
+		*last = cur;
+		last = &cur->next;
+	}
+	return ret;
+}
+
 void
 drw_fontset_free(Fnt *font)
 {
@@ -222,6 +536,20 @@ drw_setscheme(Drw *drw, Clr *scm)
 		drw->scheme = scm;
 }
 
+Drawable
+drw_settarget(Drw *drw, Drawable target)
+{
+	Drawable prev;
+
+	if (!drw)
+		return None;
+
+	prev = drw->drawable;
+	drw->drawable = target;
+	XftDrawChange(drw->xftdraw, target);
+	return prev;
+}
+
 void
 drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert)
 {
@@ -234,25 +562,108 @@ drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int
 		XDrawRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w - 1, h - 1);
 }
 
+Txt *
+drw_txt_create(const char *text)
+{
+	Txt *txt = ecalloc(1, sizeof(Txt));
+	const unsigned char *c = (const unsigned char *)text;
+	size_t i = 0, k, n = strlen(text);
+	long u;
+
+	/* never more codepoints than bytes, invalid input is replaced here
+	 * once, so everything after deals with valid codepoints only */
+	txt->text = ecalloc(n + 1, sizeof(*txt->text));
+	while (i < n) {
+		k = asciidecode(&c[i], n - i, &txt->text[txt->len]);
+		i += k;
+		txt->len += k;
+		if (i < n) {
+			i += utf8decode(&c[i], &u);
+			txt->text[txt->len++] = u;
+		}
+	}
+	/* decks can be large, keep only what multibyte text did not use */
+	if (txt->len < n && !(txt->text = realloc(txt->text, (txt->len + 1) * sizeof(*txt->text))))
+		die("realloc:");
+
+	return txt;
+}
+
+void
+drw_txt_free(Txt *txt)
+{
+	if (!txt)
+		return;
+	free(txt->text);
+	free(txt->runs);
+	free(txt->fonts);
+	free(txt);
+}
+
+void
+drw_txt_segment(Drw *drw, Txt *txt)
+{
+	size_t i;
+	int font;
+
+	if (txt->runs)
+		return;
+	txt->runs = ecalloc(txt->len + 1, sizeof(*txt->runs));
+	txt->fonts = ecalloc(txt->len + 1, sizeof(*txt->fonts));
+	for (i = 0; i < txt->len; i++) {
+		font = fntindex(drw, txt->text[i]);
+		if (!i || font != txt->fonts[txt->runcount - 1]) {
+			txt->fonts[txt->runcount] = font;
+			txt->runs[txt->runcount++] = i;
+		}
+	}
+	txt->runs[txt->runcount] = txt->len;
+	/* most lines are a single run */
+	if (!(txt->runs = realloc(txt->runs, (txt->runcount + 1) * sizeof(*txt->runs))) ||
+	    !(txt->fonts = realloc(txt->fonts, (txt->runcount + 1) * sizeof(*txt->fonts))))
+		die("realloc:");
+}
+
+/* Queue the glyphs of the n codepoints in text in font, starting at x on
+ * baseline y. Returns their width. */
+static int
+glyphsadd(Drw *drw, Fnt *font, const FcChar32 *text, size_t n, int x, int y)
+{
+	XftGlyphFontSpec *spec;
+	XGlyphInfo ext;
+	int x0 = x;
+
+	for (; n; n--, text++) {
+		if (drw->glyphcount == drw->glyphsize) {
+			drw->glyphsize = drw->glyphsize ? 2 * drw->glyphsize : 256;
+			if (!(drw->glyphs = realloc(drw->glyphs, drw->glyphsize * sizeof(*drw->glyphs))) ||
+			    !(drw->glyphx = realloc(drw->glyphx, drw->glyphsize * sizeof(*drw->glyphx))))
+				die("realloc:");
+		}
+		drw->glyphx[drw->glyphcount] = x;
+		spec = &drw->glyphs[drw->glyphcount++];
+		spec->font = font->xfont;
+		spec->glyph = XftCharIndex(drw->dpy, font->xfont, *text);
+		spec->x = x;
+		spec->y = y;
+		XftGlyphExtents(drw->dpy, font->xfont, &spec->glyph, 1, &ext);
+		x += ext.xOff;
+	}
+	return x - x0;
+}
+
 int
-drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert)
+drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, Txt *txt, int invert)
 {
-	char buf[1024];
-	int ty;
-	unsigned int ew;
-	XftDraw *d = NULL;
-	Fnt *usedfont, *curfont, *nextfont;
-	size_t i, len;
-	int utf8strlen, utf8charlen, render = x || y || w || h;
-	long utf8codepoint = 0;
-	const char *utf8str;
-	FcCharSet *fccharset;
-	FcPattern *fcpattern;
-	FcPattern *match;
-	XftResult result;
-	int charexists = 0;
+	static const FcChar32 dots[] = { '.', '.', '.' };
+	int ty, lo, hi, mid;
+	unsigned int ew, dotw;
+	XGlyphInfo ext;
+	Fnt *font;
+	size_t i, start, run;
+	int render = x || y || w || h;
 
-	if (!drw || (render && !drw->scheme) || !text || !drw->fonts)
+	if (!drw || (render && !drw->scheme) || !txt || !drw->fonts)
 		return 0;
 
 	if (!render) {
@@ -260,141 +671,110 @@ drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lp
 	} else {
 		XSetForeground(drw->dpy, drw->gc, drw->scheme[invert ? ColFg : ColBg].pixel);
 		XFillRectangle(drw->dpy, drw->drawable, drw->gc, x, y, w, h);
-		d = XftDrawCreate(drw->dpy, drw->drawable,
-		                  DefaultVisual(drw->dpy, drw->screen),
-		                  DefaultColormap(drw->dpy, drw->screen));
 		x += lpad;
 		w -= lpad;
 	}
 
-	usedfont = drw->fonts;
-	while (1) {
-		utf8strlen = 0;
-		utf8str = text;
-		nextfont = NULL;
-		while (*text) {
-			utf8charlen = utf8decode(text, &utf8codepoint, UTF_SIZ);
-			for (curfont = drw->fonts; curfont; curfont = curfont->next) {
-				charexists = charexists || XftCharExists(drw->dpy, curfont->xfont, utf8codepoint);
-				if (charexists) {
-					if (curfont == usedfont) {
-						utf8strlen += utf8charlen;
-						text += utf8charlen;
-					} else {
-						nextfont = curfont;
-					}
-					break;
-				}
+	drw_txt_segment(drw, txt);
+
+	/* all runs are drawn at once in the end */
+	drw->glyphcount = 0;
+	for (run = 0; run < txt->runcount; run++) {
+		font = fntget(drw, txt->fonts[run]);
+		i = txt->runs[run];
+		start = drw->glyphcount;
+		ty = y + (h - font->h) / 2 + font->xfont->ascent;
+		ew = glyphsadd(drw, font, &txt->text[i], txt->runs[run + 1] - i, x, ty);
+		/* shorten text if necessary, the glyph positions are the widths of
+		 * each prefix */
+		if (ew > w) {
+			XftTextExtents32(drw->dpy, font->xfont, dots, 3, &ext);
+			dotw = ext.xOff;
+			for (lo = 0, hi = drw->glyphcount - start - 1; lo < hi; ) {
+				mid = (lo + hi + 1) / 2;
+				if (drw->glyphx[start + mid] - x + dotw <= w)
+					lo = mid;
+				else
+					hi = mid - 1;
 			}
-
-			if (!charexists || nextfont)
-				break;
-			else
-				charexists = 0;
-		}
-
-		if (utf8strlen) {
-			drw_font_getexts(usedfont, utf8str, utf8strlen, &ew, NULL);
-			/* shorten text if necessary */
-			for (len = MIN(utf8strlen, sizeof(buf) - 1); len && ew > w; len--)
-				drw_font_getexts(usedfont, utf8str, len, &ew, NULL);
-
-			if (len) {
-				memcpy(buf, utf8str, len);
-				buf[len] = '\0';
-				if (len < utf8strlen)
-					for (i = len; i && i > len - 3; buf[--i] = '.')
-						; /* NOP */
-
-				if (render) {
-					ty = y + (h - usedfont->h) / 2 + usedfont->xfont->ascent;
-					XftDrawStringUtf8(d, &drw->scheme[invert ? ColBg : ColFg],
-					                  usedfont->xfont, x, ty, (XftChar8 *)buf, len);
-				}
-				x += ew;
-				w -= ew;
-			}
-		}
-
-		if (!*text) {
+			ew = drw->glyphx[start + lo] - x;
+			drw->glyphcount = start + lo;
+			if (dotw <= w - ew)
+				ew += glyphsadd(drw, font, dots, 3, x + ew, ty);
+			x += ew;
+			w -= ew;
+			/* nothing after it fits either */
 			break;
-		} else if (nextfont) {
-			charexists = 0;
-			usedfont = nextfont;
-		} else {
-			/* Regardless of whether or not a fallback font is found, the
-			 * character must be drawn. */
-			charexists = 1;
-
-			fccharset = FcCharSetCreate();
-			FcCharSetAddChar(fccharset, utf8codepoint);
-
-			if (!drw->fonts->pattern) {
-				/* Refer to the comment in xfont_create for more information. */
-				die("the first font in the cache must be loaded from a font string.");
-			}
-
-			fcpattern = FcPatternDuplicate(drw->fonts->pattern);
-			FcPatternAddCharSet(fcpattern, FC_CHARSET, fccharset);
-			FcPatternAddBool(fcpattern, FC_SCALABLE, FcTrue);
-
-			FcConfigSubstitute(NULL, fcpattern, FcMatchPattern);
-			FcDefaultSubstitute(fcpattern);
-			match = XftFontMatch(drw->dpy, drw->screen, fcpattern, &result);
-
-			FcCharSetDestroy(fccharset);
-			FcPatternDestroy(fcpattern);
-
-			if (match) {
-				usedfont = xfont_create(drw, NULL, match);
-				if (usedfont && XftCharExists(drw->dpy, usedfont->xfont, utf8codepoint)) {
-					for (curfont = drw->fonts; curfont->next; curfont = curfont->next)
-						; /* NOP */
-					curfont->next = usedfont;
-				} else {
-					xfont_free(usedfont);
-					usedfont = drw->fonts;
-				}
-			}
 		}
+		x += ew;
+		w -= ew;
 	}
-	if (d)
-		XftDrawDestroy(d);
+	if (render && drw->glyphcount)
+		XftDrawGlyphFontSpec(drw->xftdraw, &drw->scheme[invert ? ColBg : ColFg],
+		                     drw->glyphs, drw->glyphcount);
 
 	return x + (render ? w : 0);
 }
 
-void
-drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h)
+unsigned int
+drw_fontset_getwidth(Drw *drw, Txt *txt)
 {
-	if (!drw)
-		return;
+	if (!drw || !drw->fonts || !txt)
+		return 0;
+	return drw_text(drw, 0, 0, 0, 0, 0, txt, 0);
+}
 
-	XCopyArea(drw->dpy, drw->drawable, win, drw->gc, x, y, w, h, x, y);
-	XSync(drw->dpy, False);
+/* Pattern of the font with index i, at the size of set. */
+static FcPattern *
+fntpattern(Drw *drw, Fnt *set, int i)
+{
+	if (i == NOFONT)
+		return set->xfont->pattern;
+	if (i < 0)
+		return drw->fallbacks[FALLBACK(i)];
+	for (; i && set->next; i--)
+		set = set->next;
+	return set->xfont->pattern;
 }
 
-unsigned int
-drw_fontset_getwidth(Drw *drw, const char *text)
+/* Pixel size of set scaled to size points, as drw_fontset_scale() opens it. */
+static double
+fntpixelsize(Fnt *set, double size)
 {
-	if (!drw || !drw->fonts || !text)
-		return 0;
-	return drw_text(drw, 0, 0, 0, 0, 0, text, 0);
+	double pixelsize, oldsize;
+
+	if (FcPatternGetDouble(set->xfont->pattern, FC_PIXEL_SIZE, 0, &pixelsize) != FcResultMatch)
+		return size;
+	if (FcPatternGetDouble(set->xfont->pattern, FC_SIZE, 0, &oldsize) != FcResultMatch || oldsize <= 0)
+		return pixelsize;
+	return pixelsize * size / oldsize;
 }
 
-void
-drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h)
+unsigned int
+drw_fontset_measure(Drw *drw, Fnt *set, double size, Txt *txt)
 {
-	XGlyphInfo ext;
+	double pixelsize;
+	unsigned int w = 0;
+	size_t run;
 
-	if (!font || !text)
-		return;
+	if (!drw || !set || !txt)
+		return 0;
 
-	XftTextExtentsUtf8(font->dpy, font->xfont, (XftChar8 *)text, len, &ext);
-	if (w)
-		*w = ext.xOff;
-	if (h)
-		*h = font->h;
+	drw_txt_segment(drw, txt);
+	pixelsize = fntpixelsize(set, size);
+	for (run = 0; run < txt->runcount; run++)
+		w += measurewidth(fntpattern(drw, set, txt->fonts[run]), pixelsize,
+		                  &txt->text[txt->runs[run]],
+		                  txt->runs[run + 1] - txt->runs[run]);
+	return w;
+}
+
+unsigned int
+drw_fontset_measureheight(Fnt *set, double size)
+{
+	if (!set)
+		return 0;
+	return measureheight(set->xfont->pattern, fntpixelsize(set, size));
 }
 
 Cur *
@@ -10,8 +10,19 @@ typedef struct Fnt {
 	XftFont *xfont;
 	FcPattern *pattern;
 	struct Fnt *next;
+	struct Fnt **fallbacks; /* Drw.fallbacks at this size, kept by the first of a set */
+	size_t fallbackcount;
 } Fnt;
 
+/* text decoded once, split into runs drawn with one font on first use */
+typedef struct {
+	FcChar32 *text;
+	size_t len;
+	size_t *runs;  /* start of each run, and len after the last */
+	int *fonts;    /* font of each run, the same for all sizes */
+	size_t runcount;
+} Txt;
+
 enum { ColFg, ColBg }; /* Clr scheme index */
 typedef XftColor Clr;
 
@@ -21,9 +32,16 @@ typedef struct {
 	int screen;
 	Window root;
 	Drawable drawable;
+	XftDraw *xftdraw;
 	GC gc;
 	Clr *scheme;
 	Fnt *fonts;
+	struct Fntcache *coverage; /* index of the font drawing each codepoint */
+	FcPattern **fallbacks;     /* fallback fonts found so far, shared by all sizes */
+	size_t fallbackcount;
+	XftGlyphFontSpec *glyphs; /* glyphs of the line being drawn */
+	int *glyphx;              /* their positions, unlike glyphs[].x not limited to short */
+	size_t glyphcount, glyphsize;
 } Drw;
 
 /* Drawable abstraction */
@@ -33,9 +51,19 @@ void drw_free(Drw *drw);
 
 /* Fnt abstraction */
 Fnt *drw_fontset_create(Drw* drw, const char *fonts[], size_t fontcount);
+Fnt *drw_fontset_scale(Drw *drw, Fnt *set, double size);
 void drw_fontset_free(Fnt* set);
-unsigned int drw_fontset_getwidth(Drw *drw, const char *text);
-void drw_font_getexts(Fnt *font, const char *text, unsigned int len, unsigned int *w, unsigned int *h);
+unsigned int drw_fontset_getwidth(Drw *drw, Txt *txt);
+/* Width of txt and height of set scaled to size points, measured with
+ * FreeType instead of the X server. They only read drw and set, so they may
+ * run on several threads at once as long as txt has been segmented. */
+unsigned int drw_fontset_measure(Drw *drw, Fnt *set, double size, Txt *txt);
+unsigned int drw_fontset_measureheight(Fnt *set, double size);
+
+/* Txt abstraction */
+Txt *drw_txt_create(const char *text);
+void drw_txt_free(Txt *txt);
+void drw_txt_segment(Drw *drw, Txt *txt); /* split into runs of one font each */
 
 /* Colorscheme abstraction */
 void drw_clr_create(Drw *drw, Clr *dest, const char *clrname);
@@ -48,10 +76,10 @@ void drw_cur_free(Drw *drw, Cur *cursor);
 /* Drawing context manipulation */
 void drw_setfontset(Drw *drw, Fnt *set);
 void drw_setscheme(Drw *drw, Clr *scm);
+/* Draw into target, of the default depth, until set back. Returns the
+ * drawable drawn into so far. */
+Drawable drw_settarget(Drw *drw, Drawable target);
 
 /* Drawing functions */
 void drw_rect(Drw *drw, int x, int y, unsigned int w, unsigned int h, int filled, int invert);
-int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, const char *text, int invert);
-
-/* Map functions */
-void drw_map(Drw *drw, Window win, int x, int y, unsigned int w, unsigned int h);
+int drw_text(Drw *drw, int x, int y, unsigned int w, unsigned int h, unsigned int lpad, Txt *txt, int invert);
@@ -0,0 +1,249 @@
+/* See LICENSE file for copyright and license details. */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include FT_SYNTHESIS_H
+#include <fontconfig/fontconfig.h>
+#include <fontconfig/fcfreetype.h>
+
+#include "measure.h"
+#include "util.h"
+
+/* 26.6 fixed point, as Xft rounds it */
+#define ROUND(x) (((x) + 32) & -64)
+#define TRUNC(x) ((x) >> 6)
+#define DIST(a, b) ((a) > (b) ? (a) - (b) : (b) - (a))
+
+typedef struct Face {
+	char *file;
+	int index;
+	FT_Face face;
+	FT_F26Dot6 xsize, ysize; /* requested when last used */
+	struct Face *next;
+} Face;
+
+/* FreeType state of one thread, faces cannot be shared between threads */
+typedef struct {
+	FT_Library lib;
+	Face *faces;
+} Measure;
+
+/* how Xft loads the glyphs of a font */
+typedef struct {
+	FT_Face face;
+	FT_Int32 flags;
+	FcBool embolden;
+	int spacing;
+	int charwidth;
+} Info;
+
+static pthread_key_t key;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+static void
+statefree(void *p)
+{
+	Measure *m = p;
+	Face *f, *next;
+
+	for (f = m->faces; f; f = next) {
+		next = f->next;
+		FT_Done_Face(f->face);
+		free(f->file);
+		free(f);
+	}
+	FT_Done_FreeType(m->lib);
+	free(m);
+}
+
+static void
+keycreate(void)
+{
+	if (pthread_key_create(&key, statefree))
+		die("sent: Unable to create FreeType state key");
+}
+
+static Measure *
+state(void)
+{
+	Measure *m;
+
+	pthread_once(&once, keycreate);
+	if ((m = pthread_getspecific(key)))
+		return m;
+	m = ecalloc(1, sizeof(*m));
+	if (FT_Init_FreeType(&m->lib))
+		die("sent: Unable to initialize FreeType");
+	pthread_setspecific(key, m);
+	return m;
+}
+
+/* The face of file at the given index, opened on first use. */
+static Face *
+faceget(Measure *m, const char *file, int index)
+{
+	Face *f;
+
+	for (f = m->faces; f; f = f->next)
+		if (f->index == index && !strcmp(f->file, file))
+			return f;
+	f = ecalloc(1, sizeof(*f));
+	if (FT_New_Face(m->lib, file, index, &f->face)) {
+		free(f);
+		return NULL;
+	}
+	if (!(f->file = strdup(file)))
+		die("strdup:");
+	f->index = index;
+	f->next = m->faces;
+	m->faces = f;
+	return f;
+}
+
+/* Size the face like Xft does, taking the nearest strike of bitmap fonts. */
+static int
+facesize(Face *f, FT_F26Dot6 xsize, FT_F26Dot6 ysize)
+{
+	FT_Face face = f->face;
+	FT_Bitmap_Size *s;
+	int i, best = 0;
+
+	if (f->xsize == xsize && f->ysize == ysize)
+		return 1;
+	f->xsize = xsize;
+	f->ysize = ysize;
+	if (!FT_IS_SCALABLE(face)) {
+		if (!face->num_fixed_sizes)
+			return 0;
+		s = face->available_sizes;
+		for (i = 1; i < face->num_fixed_sizes; i++)
+			if (DIST(ysize, s[i].y_ppem) < DIST(ysize, s[best].y_ppem) ||
+			    (DIST(ysize, s[i].y_ppem) == DIST(ysize, s[best].y_ppem) &&
+			     s[i].height < s[best].height))
+				best = i;
+		xsize = s[best].x_ppem;
+		ysize = s[best].y_ppem;
+	}
+	if (FT_Set_Char_Size(face, xsize, ysize, 0, 0)) {
+		f->xsize = f->ysize = 0;
+		return 0;
+	}
+	return 1;
+}
+
+static FcBool
+getbool(FcPattern *font, const char *object, FcBool def)
+{
+	FcBool b;
+
+	return FcPatternGetBool(font, object, 0, &b) == FcResultMatch ? b : def;
+}
+
+static int
+getint(FcPattern *font, const char *object, int def)
+{
+	int i;
+
+	return FcPatternGetInteger(font, object, 0, &i) == FcResultMatch ? i : def;
+}
+
+/* Open font at pixelsize and work out the glyph load flags from its
+ * pattern the way Xft does. */
+static int
+infoget(Info *info, FcPattern *font, double pixelsize)
+{
+	Measure *m = state();
+	Face *f;
+	FcChar8 *file;
+	FcBool antialias;
+	double aspect;
+	int hintstyle, rgba;
+
+	if (FcPatternGetString(font, FC_FILE, 0, &file) != FcResultMatch ||
+	    !(f = faceget(m, (char *)file, getint(font, FC_INDEX, 0))))
+		return 0;
+	if (FcPatternGetDouble(font, FC_ASPECT, 0, &aspect) != FcResultMatch)
+		aspect = 1;
+	if (!facesize(f, (FT_F26Dot6)(pixelsize * aspect * 64), (FT_F26Dot6)(pixelsize * 64)))
+		return 0;
+
+	info->face = f->face;
+	info->flags = FT_LOAD_DEFAULT;
+	antialias = getbool(font, FC_ANTIALIAS, FcTrue);
+	if (antialias && !getbool(font, "embeddedbitmap", FcFalse))
+		info->flags |= FT_LOAD_NO_BITMAP;
+	if (!getbool(font, FC_HINTING, FcTrue))
+		info->flags |= FT_LOAD_NO_HINTING;
+	hintstyle = getint(font, FC_HINT_STYLE, FC_HINT_FULL);
+	rgba = getint(font, FC_RGBA, FC_RGBA_UNKNOWN);
+	if (!antialias)
+		info->flags |= FT_LOAD_TARGET_MONO;
+	else if (hintstyle == FC_HINT_NONE)
+		info->flags |= FT_LOAD_NO_HINTING;
+	else if (hintstyle == FC_HINT_SLIGHT)
+		info->flags |= FT_LOAD_TARGET_LIGHT;
+	else if (hintstyle == FC_HINT_FULL && (rgba == FC_RGBA_RGB || rgba == FC_RGBA_BGR))
+		info->flags |= FT_LOAD_TARGET_LCD;
+	else if (hintstyle == FC_HINT_FULL && (rgba == FC_RGBA_VRGB || rgba == FC_RGBA_VBGR))
+		info->flags |= FT_LOAD_TARGET_LCD_V;
+	if (getbool(font, FC_AUTOHINT, FcFalse))
+		info->flags |= FT_LOAD_FORCE_AUTOHINT;
+	if (!getbool(font, FC_GLOBAL_ADVANCE, FcTrue))
+		info->flags |= FT_LOAD_IGNORE_GLOBAL_ADVANCE_WIDTH;
+	info->embolden = getbool(font, FC_EMBOLDEN, FcFalse);
+	info->spacing = getint(font, FC_SPACING, FC_PROPORTIONAL);
+	info->charwidth = getint(font, "charwidth", 0);
+	return 1;
+}
+
+unsigned int
+measurewidth(FcPattern *font, double pixelsize, const FcChar32 *text, size_t n)
+{
+	Info info;
+	FT_UInt glyph;
+	unsigned int w = 0;
+
+	if (!infoget(&info, font, pixelsize))
+		return 0;
+	if (info.spacing >= FC_MONO)
+		return n * (info.charwidth ? info.charwidth :
+		            TRUNC(info.face->size->metrics.max_advance));
+	for (; n; n--, text++) {
+		glyph = FcFreeTypeCharIndex(info.face, *text);
+		/* Xft falls back to bitmaps before giving up on a glyph */
+		if (FT_Load_Glyph(info.face, glyph, info.flags) &&
+		    (!(info.flags & FT_LOAD_NO_BITMAP) ||
+		     FT_Load_Glyph(info.face, glyph, info.flags & ~FT_LOAD_NO_BITMAP)))
+			continue;
+		if (info.embolden)
+			FT_GlyphSlot_Embolden(info.face->glyph);
+		w += TRUNC(ROUND(info.face->glyph->advance.x));
+	}
+	return w;
+}
+
+unsigned int
+measureheight(FcPattern *font, double pixelsize)
+{
+	Info info;
+	FT_Size_Metrics *metrics;
+
+	if (!infoget(&info, font, pixelsize))
+		return 0;
+	metrics = &info.face->size->metrics;
+	return TRUNC(metrics->ascender) - TRUNC(metrics->descender);
+}
+
+void
+measurefree(void)
+{
+	Measure *m;
+
+	pthread_once(&once, keycreate);
+	if ((m = pthread_getspecific(key))) {
+		statefree(m);
+		pthread_setspecific(key, NULL);
+	}
+}
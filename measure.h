@@ -0,0 +1,16 @@
+/* See LICENSE file for copyright and license details. */
+
+/* Text measurement straight from the font files with FreeType, giving the
+ * same results as Xft for fonts matched by fontconfig but without a display.
+ * Each thread keeps FreeType state of its own, so all of it may be used from
+ * several threads at once. */
+
+/* Width of the n codepoints in text in font at pixelsize, 0 if the font
+ * cannot be loaded. */
+unsigned int measurewidth(FcPattern *font, double pixelsize, const FcChar32 *text, size_t n);
+
+/* Ascent plus descent of font at pixelsize, like XftFont. */
+unsigned int measureheight(FcPattern *font, double pixelsize);
+
+/* Release the state of the calling thread. */
+void measurefree(void);
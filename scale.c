@@ -0,0 +1,857 @@
+/* See LICENSE file for copyright and license details. */
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "scale.h"
+#include "util.h"
+
+#define FIXBITS 14 /* fractional bits of the filter weights */
+#define FIXONE  (1 << FIXBITS)
+
+/* tables kept around for scaling to the same geometry again */
+#define NUMWEIGHTS 8
+
+/* contributions of the source samples to each destination sample */
+typedef struct {
+	unsigned int slen, dlen;
+	int filter;
+	unsigned long used;
+	unsigned int n;      /* taps per destination sample */
+	unsigned int *start; /* first source sample of each destination sample */
+	int16_t *w;          /* n fixed-point weights per destination sample */
+	int32_t *pairs;      /* the weights packed two by two, zero padded */
+} Weights;
+
+typedef struct Job Job;
+
+static Weights wcache[NUMWEIGHTS];
+static Conv conv = NULL;        /* to the destination format */
+static unsigned int convbpp = 4; /* destination bytes per pixel */
+static unsigned long wcachetick = 0;
+
+/* thread pool */
+static pthread_t *workers = NULL;
+static unsigned int nthreads = 0;
+static pthread_mutex_t poollock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poolwork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pooldone = PTHREAD_COND_INITIALIZER;
+static int poolquit = 0;
+static Job *job = NULL;           /* job being worked on */
+static unsigned int jobnext = 0;  /* next band to hand out */
+static unsigned int jobleft = 0;  /* bands not finished yet */
+
+static uint8_t
+clamp8(int32_t v)
+{
+	v >>= FIXBITS;
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static double
+sinc(double x)
+{
+	return x == 0 ? 1 : sin(M_PI * x) / (M_PI * x);
+}
+
+static double
+bicubic(double x)
+{
+	/* Catmull-Rom, a = -0.5 */
+	x = fabs(x);
+	if (x < 1)
+		return (1.5 * x - 2.5) * x * x + 1;
+	if (x < 2)
+		return ((-0.5 * x + 2.5) * x - 4) * x + 2;
+	return 0;
+}
+
+static double
+lanczos(double x)
+{
+	return fabs(x) < 3 ? sinc(x) * sinc(x / 3) : 0;
+}
+
+/* Weights of the source samples covered by destination sample i, in
+ * proportion to the covered area. */
+static void
+taparea(double *fw, unsigned int *start, unsigned int n, unsigned int slen,
+        double s, unsigned int i)
+{
+	double lo = i * s, hi = MIN((i + 1) * s, slen);
+	unsigned int j, first = lo, last = MIN((unsigned int)ceil(hi), slen) - 1;
+
+	/* keep the taps inside the source */
+	*start = MIN(first, slen - n);
+	for (j = first; j <= last; j++)
+		fw[j - *start] = (MIN(j + 1.0, hi) - MAX((double)j, lo)) / s;
+}
+
+/* Weights of the kernel k with the given support centered on destination
+ * sample i, stretched when shrinking. Taps beyond the edges are folded
+ * onto the edge samples. */
+static void
+tapkernel(double *fw, unsigned int *start, unsigned int n, unsigned int slen,
+          double s, unsigned int i, double (*k)(double), double support)
+{
+	double fs = MAX(s, 1.0), c = (i + 0.5) * s - 0.5, sum = 0;
+	long j, lo = (long)floor(c - support * fs) + 1;
+	long hi = (long)floor(c + support * fs);
+	unsigned int t;
+
+	*start = MIN((unsigned long)MAX(lo, 0), slen - n);
+	for (j = lo; j <= hi; j++)
+		fw[MIN((unsigned long)MAX(j, 0), slen - 1) - *start] += k((j - c) / fs);
+	for (t = 0; t < n; t++)
+		sum += fw[t];
+	for (t = 0; t < n && sum != 0; t++)
+		fw[t] /= sum;
+}
+
+static void
+weightscompute(Weights *wt, unsigned int slen, unsigned int dlen, int filter)
+{
+	double s = (double)slen / dlen, f[64], *fw = f, support;
+	unsigned int i, k, max, np;
+	int sum;
+	int16_t *w;
+
+	switch (filter) {
+	case ScaleBicubic:
+		support = 2;
+		break;
+	case ScaleLanczos:
+		support = 3;
+		break;
+	default:
+		support = 0.5;
+		break;
+	}
+	wt->slen = slen;
+	wt->dlen = dlen;
+	wt->filter = filter;
+	wt->n = MIN((unsigned int)ceil(2 * support * MAX(s, 1.0)) + 1, slen);
+	wt->start = ecalloc(dlen, sizeof(*wt->start));
+	wt->w = ecalloc((size_t)dlen * wt->n, sizeof(*wt->w));
+	np = (wt->n + 1) / 2;
+	wt->pairs = ecalloc((size_t)dlen * np, sizeof(*wt->pairs));
+	if (wt->n > sizeof(f) / sizeof(f[0]))
+		fw = ecalloc(wt->n, sizeof(*fw));
+
+	for (i = 0; i < dlen; i++) {
+		for (k = 0; k < wt->n; k++)
+			fw[k] = 0;
+		switch (filter) {
+		case ScaleBicubic:
+			tapkernel(fw, &wt->start[i], wt->n, slen, s, i, bicubic, support);
+			break;
+		case ScaleLanczos:
+			tapkernel(fw, &wt->start[i], wt->n, slen, s, i, lanczos, support);
+			break;
+		default:
+			taparea(fw, &wt->start[i], wt->n, slen, s, i);
+			break;
+		}
+
+		/* round to fixed point, the largest weight absorbs the error */
+		w = &wt->w[(size_t)i * wt->n];
+		for (sum = 0, max = 0, k = 0; k < wt->n; k++) {
+			w[k] = lround(fw[k] * FIXONE);
+			sum += w[k];
+			if (w[k] > w[max])
+				max = k;
+		}
+		w[max] += FIXONE - sum;
+
+		for (k = 0; k < wt->n; k++)
+			wt->pairs[(size_t)i * np + k / 2] |=
+				(uint32_t)(uint16_t)w[k] << (k % 2 * 16);
+	}
+
+	if (fw != f)
+		free(fw);
+}
+
+static void
+weightsfree(Weights *wt)
+{
+	free(wt->start);
+	free(wt->w);
+	free(wt->pairs);
+	memset(wt, 0, sizeof(*wt));
+}
+
+/* Return the table for scaling slen to dlen samples, computing it only if
+ * it is not cached yet. */
+static const Weights *
+weights(unsigned int slen, unsigned int dlen, int filter)
+{
+	unsigned int i, lru = 0;
+
+	for (i = 0; i < NUMWEIGHTS; i++) {
+		if (wcache[i].n && wcache[i].slen == slen &&
+		    wcache[i].dlen == dlen && wcache[i].filter == filter) {
+			wcache[i].used = ++wcachetick;
+			return &wcache[i];
+		}
+		if (wcache[i].used < wcache[lru].used)
+			lru = i;
+	}
+	weightsfree(&wcache[lru]);
+	weightscompute(&wcache[lru], slen, dlen, filter);
+	wcache[lru].used = ++wcachetick;
+	return &wcache[lru];
+}
+
+/* Converters from XRGB8888 to the pixel formats of common visuals. Each
+ * is a fixed pack expression stored with a fixed byte order. */
+#define PUT32LSB(o, v) ((o)[0] = (v), (o)[1] = (v) >> 8, (o)[2] = (v) >> 16, (o)[3] = (v) >> 24)
+#define PUT32MSB(o, v) ((o)[0] = (v) >> 24, (o)[1] = (v) >> 16, (o)[2] = (v) >> 8, (o)[3] = (v))
+#define PUT24LSB(o, v) ((o)[0] = (v), (o)[1] = (v) >> 8, (o)[2] = (v) >> 16)
+#define PUT24MSB(o, v) ((o)[0] = (v) >> 16, (o)[1] = (v) >> 8, (o)[2] = (v))
+#define PUT16LSB(o, v) ((o)[0] = (v), (o)[1] = (v) >> 8)
+#define PUT16MSB(o, v) ((o)[0] = (v) >> 8, (o)[1] = (v))
+
+#define XRGB(p)   (p)
+#define XBGR(p)   (((p) >> 16 & 0xff) | ((p) & 0xff00) | ((p) & 0xff) << 16)
+#define RGB30(p)  (((p) & 0xff0000) << 6 | ((p) & 0xc00000) >> 2 | \
+                   ((p) & 0xff00) << 4 | ((p) & 0xc000) >> 4 | \
+                   ((p) & 0xff) << 2 | ((p) & 0xc0) >> 6)
+#define RGB565(p) (((p) >> 8 & 0xf800) | ((p) >> 5 & 0x07e0) | ((p) >> 3 & 0x001f))
+#define RGB555(p) (((p) >> 9 & 0x7c00) | ((p) >> 6 & 0x03e0) | ((p) >> 3 & 0x001f))
+
+#define CONVERTER(name, bytes, put, pack) \
+static void \
+name(const uint32_t *in, unsigned char *out, unsigned int n) \
+{ \
+	uint32_t v; \
+	for (; n; n--, in++, out += (bytes)) { \
+		v = pack(*in); \
+		put(out, v); \
+	} \
+}
+
+CONVERTER(xrgb32lsb, 4, PUT32LSB, XRGB)
+CONVERTER(xrgb32msb, 4, PUT32MSB, XRGB)
+CONVERTER(xbgr32lsb, 4, PUT32LSB, XBGR)
+CONVERTER(xbgr32msb, 4, PUT32MSB, XBGR)
+CONVERTER(rgb30lsb,  4, PUT32LSB, RGB30)
+CONVERTER(rgb30msb,  4, PUT32MSB, RGB30)
+CONVERTER(rgb24lsb,  3, PUT24LSB, XRGB)
+CONVERTER(rgb24msb,  3, PUT24MSB, XRGB)
+CONVERTER(rgb565lsb, 2, PUT16LSB, RGB565)
+CONVERTER(rgb565msb, 2, PUT16MSB, RGB565)
+CONVERTER(rgb555lsb, 2, PUT16LSB, RGB555)
+CONVERTER(rgb555msb, 2, PUT16MSB, RGB555)
+
+static const struct {
+	unsigned long rmask, gmask, bmask;
+	int bpp;
+	Conv lsb, msb;
+} converters[] = {
+	{ 0xff0000,   0xff00,  0xff,       32, xrgb32lsb, xrgb32msb },
+	{ 0xff,       0xff00,  0xff0000,   32, xbgr32lsb, xbgr32msb },
+	{ 0x3ff00000, 0xffc00, 0x3ff,      32, rgb30lsb,  rgb30msb  },
+	{ 0xff0000,   0xff00,  0xff,       24, rgb24lsb,  rgb24msb  },
+	{ 0xf800,     0x07e0,  0x001f,     16, rgb565lsb, rgb565msb },
+	{ 0x7c00,     0x03e0,  0x001f,     16, rgb555lsb, rgb555msb },
+};
+
+/* layout of the destination pixels, for the generic converter */
+static unsigned long convmask[3];
+static int convshift[3], convbits[3], convmsb;
+
+static void
+generic(const uint32_t *in, unsigned char *out, unsigned int n)
+{
+	unsigned int c, b;
+	uint32_t v, ch;
+
+	for (; n; n--, in++, out += convbpp) {
+		for (v = 0, c = 0; c < 3; c++) {
+			ch = *in >> (16 - 8 * c) & 0xff;
+			ch = convbits[c] <= 8 ? ch >> (8 - convbits[c]) :
+			     ch << (convbits[c] - 8) | ch >> (16 - convbits[c]);
+			v |= ch << convshift[c] & convmask[c];
+		}
+		for (b = 0; b < convbpp; b++)
+			out[convmsb ? convbpp - 1 - b : b] = v >> (8 * b);
+	}
+}
+
+Conv
+convfind(unsigned long rmask, unsigned long gmask, unsigned long bmask,
+         int bpp, int msbfirst)
+{
+	const uint16_t one = 1;
+	unsigned long m;
+	unsigned int i;
+
+	convbpp = bpp / 8;
+	for (i = 0; i < sizeof(converters) / sizeof(converters[0]); i++) {
+		if (converters[i].rmask != rmask || converters[i].gmask != gmask ||
+		    converters[i].bmask != bmask || converters[i].bpp != bpp)
+			continue;
+		/* the internal format itself needs no converting at all */
+		if (i == 0 && msbfirst == !*(const uint8_t *)&one)
+			return conv = NULL;
+		return conv = msbfirst ? converters[i].msb : converters[i].lsb;
+	}
+
+	convmask[0] = rmask;
+	convmask[1] = gmask;
+	convmask[2] = bmask;
+	for (i = 0; i < 3; i++) {
+		for (m = convmask[i], convshift[i] = 0; m && !(m & 1); m >>= 1)
+			convshift[i]++;
+		for (convbits[i] = 0; m & 1; m >>= 1)
+			convbits[i]++;
+	}
+	convmsb = msbfirst;
+
+	return conv = generic;
+}
+
+/* Filter the n source rows starting at src into the w pixels at out. */
+static void
+vpass(const uint32_t *src, size_t stride, unsigned int w, unsigned int n,
+      const int16_t *k, uint32_t *out)
+{
+	unsigned int x = 0, i;
+	int32_t r, g, b;
+	uint32_t p;
+
+#ifdef __AVX2__
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i r0, r1, kk, l0, l1, h0, h1, a0, a1, a2, a3;
+
+	/* the unpacks and packs stay within 128 bit lanes, so each lane
+	 * holds four pixels just like in the SSE2 loop below */
+	for (; x + 8 <= w; x += 8) {
+		a0 = a1 = a2 = a3 = _mm256_set1_epi32(1 << (FIXBITS - 1));
+		for (i = 0; i < n; i += 2) {
+			r0 = _mm256_loadu_si256((const __m256i *)&src[i * stride + x]);
+			if (i + 1 < n) {
+				r1 = _mm256_loadu_si256((const __m256i *)&src[(i + 1) * stride + x]);
+				kk = _mm256_set1_epi32((uint16_t)k[i] | (uint32_t)(uint16_t)k[i + 1] << 16);
+			} else {
+				r1 = zero;
+				kk = _mm256_set1_epi32((uint16_t)k[i]);
+			}
+			l0 = _mm256_unpacklo_epi8(r0, zero);
+			l1 = _mm256_unpacklo_epi8(r1, zero);
+			h0 = _mm256_unpackhi_epi8(r0, zero);
+			h1 = _mm256_unpackhi_epi8(r1, zero);
+			a0 = _mm256_add_epi32(a0, _mm256_madd_epi16(_mm256_unpacklo_epi16(l0, l1), kk));
+			a1 = _mm256_add_epi32(a1, _mm256_madd_epi16(_mm256_unpackhi_epi16(l0, l1), kk));
+			a2 = _mm256_add_epi32(a2, _mm256_madd_epi16(_mm256_unpacklo_epi16(h0, h1), kk));
+			a3 = _mm256_add_epi32(a3, _mm256_madd_epi16(_mm256_unpackhi_epi16(h0, h1), kk));
+		}
+		a0 = _mm256_packs_epi32(_mm256_srai_epi32(a0, FIXBITS), _mm256_srai_epi32(a1, FIXBITS));
+		a2 = _mm256_packs_epi32(_mm256_srai_epi32(a2, FIXBITS), _mm256_srai_epi32(a3, FIXBITS));
+		_mm256_storeu_si256((__m256i *)&out[x], _mm256_packus_epi16(a0, a2));
+	}
+#endif
+#ifdef __SSE2__
+	const __m128i zero4 = _mm_setzero_si128();
+	__m128i s0, s1, kw, lo0, lo1, hi0, hi1, c0, c1, c2, c3;
+
+	/* two source rows at a time: interleave their channels so that
+	 * madd computes row0 * k[i] + row1 * k[i + 1] per channel */
+	for (; x + 4 <= w; x += 4) {
+		c0 = c1 = c2 = c3 = _mm_set1_epi32(1 << (FIXBITS - 1));
+		for (i = 0; i < n; i += 2) {
+			s0 = _mm_loadu_si128((const __m128i *)&src[i * stride + x]);
+			if (i + 1 < n) {
+				s1 = _mm_loadu_si128((const __m128i *)&src[(i + 1) * stride + x]);
+				kw = _mm_set1_epi32((uint16_t)k[i] | (uint32_t)(uint16_t)k[i + 1] << 16);
+			} else {
+				s1 = zero4;
+				kw = _mm_set1_epi32((uint16_t)k[i]);
+			}
+			lo0 = _mm_unpacklo_epi8(s0, zero4);
+			lo1 = _mm_unpacklo_epi8(s1, zero4);
+			hi0 = _mm_unpackhi_epi8(s0, zero4);
+			hi1 = _mm_unpackhi_epi8(s1, zero4);
+			c0 = _mm_add_epi32(c0, _mm_madd_epi16(_mm_unpacklo_epi16(lo0, lo1), kw));
+			c1 = _mm_add_epi32(c1, _mm_madd_epi16(_mm_unpackhi_epi16(lo0, lo1), kw));
+			c2 = _mm_add_epi32(c2, _mm_madd_epi16(_mm_unpacklo_epi16(hi0, hi1), kw));
+			c3 = _mm_add_epi32(c3, _mm_madd_epi16(_mm_unpackhi_epi16(hi0, hi1), kw));
+		}
+		c0 = _mm_packs_epi32(_mm_srai_epi32(c0, FIXBITS), _mm_srai_epi32(c1, FIXBITS));
+		c2 = _mm_packs_epi32(_mm_srai_epi32(c2, FIXBITS), _mm_srai_epi32(c3, FIXBITS));
+		_mm_storeu_si128((__m128i *)&out[x], _mm_packus_epi16(c0, c2));
+	}
+#endif
+	for (; x < w; x++) {
+		r = g = b = 1 << (FIXBITS - 1);
+		for (i = 0; i < n; i++) {
+			p = src[i * stride + x];
+			r += k[i] * (int32_t)(p >> 16 & 0xff);
+			g += k[i] * (int32_t)(p >> 8 & 0xff);
+			b += k[i] * (int32_t)(p & 0xff);
+		}
+		out[x] = (uint32_t)clamp8(r) << 16 | clamp8(g) << 8 | clamp8(b);
+	}
+}
+
+/* Filter the row at in horizontally into the w pixels at out. The row
+ * has to extend one pixel past the last tap. */
+static void
+hpass(const uint32_t *in, unsigned int w, const Weights *wt, uint32_t *out)
+{
+	const uint32_t *p;
+	unsigned int x, i, np = (wt->n + 1) / 2;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	const int32_t *k;
+	__m128i v, acc;
+
+	for (x = 0; x < w; x++) {
+		p = &in[wt->start[x]];
+		k = &wt->pairs[(size_t)x * np];
+		acc = _mm_set1_epi32(1 << (FIXBITS - 1));
+		/* two neighbouring pixels at a time, channels interleaved as
+		 * p0.c, p1.c so that madd yields p0.c * k[i] + p1.c * k[i + 1] */
+		for (i = 0; i < np; i++) {
+			v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&p[2 * i]), zero);
+			v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(v, _mm_set1_epi32(k[i])));
+		}
+		acc = _mm_srai_epi32(acc, FIXBITS);
+		acc = _mm_packs_epi32(acc, acc);
+		out[x] = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+	}
+#else
+	const int16_t *k;
+	int32_t r, g, b;
+
+	(void)np;
+	for (x = 0; x < w; x++) {
+		p = &in[wt->start[x]];
+		k = &wt->w[(size_t)x * wt->n];
+		r = g = b = 1 << (FIXBITS - 1);
+		for (i = 0; i < wt->n; i++) {
+			r += k[i] * (int32_t)(p[i] >> 16 & 0xff);
+			g += k[i] * (int32_t)(p[i] >> 8 & 0xff);
+			b += k[i] * (int32_t)(p[i] & 0xff);
+		}
+		out[x] = (uint32_t)clamp8(r) << 16 | clamp8(g) << 8 | clamp8(b);
+	}
+#endif
+}
+
+/* one scale operation, split into bands of rows */
+struct Job {
+	const uint32_t *src;
+	unsigned int sw, sh;
+	unsigned char *dst;
+	unsigned int dw, dh;
+	size_t dstride;
+	Conv conv;              /* to the destination format, if not XRGB8888 */
+	unsigned int dbpp;      /* destination bytes per pixel */
+	const Weights *wx, *wy; /* separable filters */
+	unsigned int *xmap;     /* nearest neighbour */
+	int ratio;              /* exact integer ratio, negative to shrink */
+	void (*kernel)(const Job *, unsigned int, unsigned int, uint32_t *);
+	void (*fn)(void *, unsigned int); /* scalerun() */
+	void *arg;
+	unsigned int bandh, nbands;
+};
+
+/* Where to put the XRGB8888 pixels of destination row y: the row itself,
+ * or the scratch row tmp if they need converting. */
+static uint32_t *
+rowout(const Job *j, unsigned int y, uint32_t *tmp)
+{
+	return j->conv ? tmp : (uint32_t *)&j->dst[y * j->dstride];
+}
+
+static void
+rowdone(const Job *j, unsigned int y, uint32_t *tmp)
+{
+	if (j->conv)
+		j->conv(tmp, &j->dst[y * j->dstride], j->dw);
+}
+
+static void
+separable(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp)
+{
+	const Weights *wx = j->wx, *wy = j->wy;
+	unsigned int y;
+	uint32_t *row;
+
+	/* scratch row holding the vertically filtered source row */
+	row = ecalloc(j->sw + 1, sizeof(*row));
+	for (y = y0; y < y1; y++) {
+		vpass(&j->src[(size_t)wy->start[y] * j->sw], j->sw, j->sw, wy->n,
+		      &wy->w[(size_t)y * wy->n], row);
+		hpass(row, j->dw, wx, rowout(j, y, tmp));
+		rowdone(j, y, tmp);
+	}
+	free(row);
+}
+
+/* Kernels for exact integer ratios, spelled out so that they need no
+ * index arithmetic per pixel. */
+static void
+up2(const uint32_t *in, uint32_t *out, unsigned int w)
+{
+	unsigned int x;
+
+	for (x = 0; x + 2 <= w; x += 2, in++) {
+		out[x] = *in;
+		out[x + 1] = *in;
+	}
+	if (x < w)
+		out[x] = *in;
+}
+
+static void
+up3(const uint32_t *in, uint32_t *out, unsigned int w)
+{
+	unsigned int x;
+
+	for (x = 0; x + 3 <= w; x += 3, in++) {
+		out[x] = *in;
+		out[x + 1] = *in;
+		out[x + 2] = *in;
+	}
+	for (; x < w; x++)
+		out[x] = *in;
+}
+
+static void
+down2(const uint32_t *in, uint32_t *out, unsigned int w)
+{
+	unsigned int x;
+
+	for (x = 0; x < w; x++)
+		out[x] = in[2 * x];
+}
+
+static void
+down4(const uint32_t *in, uint32_t *out, unsigned int w)
+{
+	unsigned int x;
+
+	for (x = 0; x < w; x++)
+		out[x] = in[4 * x];
+}
+
+static void
+nearest(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp)
+{
+	unsigned int x, y, sy, prev = UINT_MAX;
+	const uint32_t *in;
+	uint32_t *out;
+
+	for (y = y0; y < y1; y++) {
+		sy = (unsigned long long)y * j->sh / j->dh;
+		/* enlarging repeats rows, copy them instead of sampling again */
+		if (sy == prev) {
+			memcpy(&j->dst[y * j->dstride], &j->dst[(y - 1) * j->dstride],
+			       (size_t)j->dw * j->dbpp);
+			continue;
+		}
+		prev = sy;
+		in = &j->src[(size_t)sy * j->sw];
+		out = rowout(j, y, tmp);
+
+		switch (j->ratio) {
+		case 2:
+			up2(in, out, j->dw);
+			break;
+		case 3:
+			up3(in, out, j->dw);
+			break;
+		case -2:
+			down2(in, out, j->dw);
+			break;
+		case -4:
+			down4(in, out, j->dw);
+			break;
+		default:
+			for (x = 0; x < j->dw; x++)
+				out[x] = in[j->xmap[x]];
+			break;
+		}
+		rowdone(j, y, tmp);
+	}
+}
+
+/* Average k x k blocks. Red and blue, and green and the unused byte, are
+ * summed two at a time in 16 bit halves of a word. */
+static inline void
+boxdown(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp,
+        const unsigned int k)
+{
+	const uint32_t half = (k * k / 2) * 0x00010001;
+	const unsigned int shift = k == 2 ? 2 : 4;
+	unsigned int x, y, u, v;
+	const uint32_t *in;
+	uint32_t *out, rb, ag, p;
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(k * k / 2);
+	__m128i r, lo, hi;
+#endif
+
+	for (y = y0; y < y1; y++) {
+		in = &j->src[(size_t)y * k * j->sw];
+		out = rowout(j, y, tmp);
+		x = 0;
+#ifdef __SSE2__
+		/* 16 bytes are four source pixels, that is two output pixels
+		 * at 1/2 and one at 1/4 */
+		for (; x + 4 / k <= j->dw; x += 4 / k, in += 4) {
+			lo = hi = zero;
+			for (v = 0; v < k; v++) {
+				r = _mm_loadu_si128((const __m128i *)&in[v * j->sw]);
+				lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(r, zero));
+				hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(r, zero));
+			}
+			if (k == 2) {
+				lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+				hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+				lo = _mm_unpacklo_epi64(lo, hi);
+			} else {
+				lo = _mm_add_epi16(lo, hi);
+				lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+			}
+			lo = _mm_srli_epi16(_mm_add_epi16(lo, round), shift);
+			lo = _mm_packus_epi16(lo, lo);
+			if (k == 2)
+				_mm_storel_epi64((__m128i *)&out[x], lo);
+			else
+				out[x] = _mm_cvtsi128_si32(lo);
+		}
+#endif
+		for (; x < j->dw; x++, in += k) {
+			rb = ag = half;
+			for (v = 0; v < k; v++) {
+				for (u = 0; u < k; u++) {
+					p = in[v * j->sw + u];
+					rb += p & 0x00ff00ff;
+					ag += p >> 8 & 0x00ff00ff;
+				}
+			}
+			out[x] = (rb >> shift & 0x00ff00ff) | (ag >> shift & 0x00ff00ff) << 8;
+		}
+		rowdone(j, y, tmp);
+	}
+}
+
+static void
+boxdown2(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp)
+{
+	boxdown(j, y0, y1, tmp, 2);
+}
+
+static void
+boxdown4(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp)
+{
+	boxdown(j, y0, y1, tmp, 4);
+}
+
+static void
+copy(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp)
+{
+	unsigned int y;
+
+	for (y = y0; y < y1; y++) {
+		if (j->conv)
+			j->conv(&j->src[(size_t)y * j->sw], &j->dst[y * j->dstride], j->dw);
+		else
+			memcpy(&j->dst[y * j->dstride], &j->src[(size_t)y * j->sw],
+			       j->sw * sizeof(*j->src));
+	}
+}
+
+static void
+band(const Job *j, unsigned int b)
+{
+	unsigned int y0 = b * j->bandh, y1 = MIN(y0 + j->bandh, j->dh);
+	uint32_t *tmp = NULL;
+
+	if (j->conv)
+		tmp = ecalloc(j->dw, sizeof(*tmp));
+	j->kernel(j, y0, y1, tmp);
+	free(tmp);
+}
+
+/* Take the next band of the current job, if any is left. */
+static int
+nextband(unsigned int *b)
+{
+	if (!job || jobnext >= job->nbands)
+		return 0;
+	*b = jobnext++;
+	return 1;
+}
+
+static void *
+worker(void *arg)
+{
+	unsigned int b;
+
+	pthread_mutex_lock(&poollock);
+	while (!poolquit) {
+		if (!nextband(&b)) {
+			pthread_cond_wait(&poolwork, &poollock);
+			continue;
+		}
+		pthread_mutex_unlock(&poollock);
+		band(job, b);
+		pthread_mutex_lock(&poollock);
+		if (--jobleft == 0)
+			pthread_cond_signal(&pooldone);
+	}
+	pthread_mutex_unlock(&poollock);
+
+	return NULL;
+}
+
+/* Run all bands of j on the pool, the calling thread included, and return
+ * once every band is done. */
+static void
+run(Job *j)
+{
+	unsigned int b;
+
+	/* a few bands per thread even out uneven progress */
+	j->nbands = MIN(j->dh, (nthreads + 1) * 4);
+	j->bandh = (j->dh + j->nbands - 1) / j->nbands;
+	j->nbands = (j->dh + j->bandh - 1) / j->bandh;
+
+	if (!nthreads) {
+		for (b = 0; b < j->nbands; b++)
+			band(j, b);
+		return;
+	}
+
+	pthread_mutex_lock(&poollock);
+	job = j;
+	jobnext = 0;
+	jobleft = j->nbands;
+	pthread_cond_broadcast(&poolwork);
+	while (nextband(&b)) {
+		pthread_mutex_unlock(&poollock);
+		band(j, b);
+		pthread_mutex_lock(&poollock);
+		jobleft--;
+	}
+	while (jobleft)
+		pthread_cond_wait(&pooldone, &poollock);
+	job = NULL;
+	pthread_mutex_unlock(&poollock);
+}
+
+void
+scaleinit(unsigned int threads)
+{
+	long n;
+	unsigned int i;
+
+	if (!threads)
+		threads = (n = sysconf(_SC_NPROCESSORS_ONLN)) > 0 ? n : 1;
+
+	/* the thread calling scale() works on bands as well */
+	nthreads = threads - 1;
+	if (nthreads)
+		workers = ecalloc(nthreads, sizeof(*workers));
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&workers[i], NULL, worker, NULL))
+			die("sent: Unable to create scaling thread");
+}
+
+/* Calls of scalerun() take the place of rows. */
+static void
+each(const Job *j, unsigned int y0, unsigned int y1, uint32_t *tmp)
+{
+	unsigned int y;
+
+	for (y = y0; y < y1; y++)
+		j->fn(j->arg, y);
+}
+
+void
+scalerun(void (*fn)(void *, unsigned int), void *arg, unsigned int n)
+{
+	Job j = { .dh = n, .kernel = each, .fn = fn, .arg = arg };
+
+	if (n)
+		run(&j);
+}
+
+void
+scale(const uint32_t *src, unsigned int sw, unsigned int sh,
+      unsigned char *dst, unsigned int dw, unsigned int dh, size_t dstride,
+      int filter)
+{
+	Job j = {
+		.src = src, .sw = sw, .sh = sh,
+		.dst = dst, .dw = dw, .dh = dh, .dstride = dstride,
+		.conv = conv, .dbpp = conv ? convbpp : 4,
+	};
+	unsigned int x;
+
+	if (!sw || !sh || !dw || !dh)
+		return;
+
+	/* exact ratios only speed up nearest neighbour, which previews use,
+	 * and the box filter when shrinking; the other filters keep going
+	 * through the separable path with its cached weight tables */
+	if (dw == 2 * sw && dh == 2 * sh)
+		j.ratio = 2;
+	else if (dw == 3 * sw && dh == 3 * sh)
+		j.ratio = 3;
+	else if (sw == 2 * dw && sh == 2 * dh)
+		j.ratio = -2;
+	else if (sw == 4 * dw && sh == 4 * dh)
+		j.ratio = -4;
+
+	if (sw == dw && sh == dh) {
+		j.kernel = copy;
+	} else if (filter == ScaleBox && j.ratio < 0) {
+		/* at 1/2 and 1/4 the box filter is a plain block average */
+		j.kernel = j.ratio == -2 ? boxdown2 : boxdown4;
+	} else if (filter == ScaleBox || filter == ScaleBicubic ||
+	           filter == ScaleLanczos) {
+		j.kernel = separable;
+		j.wx = weights(sw, dw, filter);
+		j.wy = weights(sh, dh, filter);
+	} else {
+		j.kernel = nearest;
+		j.xmap = ecalloc(dw, sizeof(*j.xmap));
+		for (x = 0; x < dw; x++)
+			j.xmap[x] = (unsigned long long)x * sw / dw;
+	}
+	run(&j);
+	free(j.xmap);
+}
+
+void
+scalefree(void)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&poollock);
+	poolquit = 1;
+	pthread_cond_broadcast(&poolwork);
+	pthread_mutex_unlock(&poollock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
+	workers = NULL;
+	nthreads = 0;
+
+	for (i = 0; i < NUMWEIGHTS; i++)
+		weightsfree(&wcache[i]);
+}
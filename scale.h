@@ -0,0 +1,28 @@
+/* See LICENSE file for copyright and license details. */
+
+enum { ScaleNearest, ScaleBox, ScaleBicubic, ScaleLanczos }; /* resampling filters */
+
+/* converts n XRGB8888 pixels to another format */
+typedef void (*Conv)(const uint32_t *in, unsigned char *out, unsigned int n);
+
+/* Select the converter to pixels with the given channel masks, bits per
+ * pixel and byte order, used by scale() from then on. Returns NULL if
+ * pixels need no converting. */
+Conv convfind(unsigned long rmask, unsigned long gmask, unsigned long bmask,
+              int bpp, int msbfirst);
+
+/* Start the pool of scaling threads, 0 means one per online CPU. */
+void scaleinit(unsigned int threads);
+
+/* Scale a sw x sh XRGB8888 image into the dw x dh image at dst, whose rows
+ * are dstride bytes apart, in the format selected by convfind(). */
+void scale(const uint32_t *src, unsigned int sw, unsigned int sh,
+           unsigned char *dst, unsigned int dw, unsigned int dh, size_t dstride,
+           int filter);
+
+/* Call fn(arg, i) for every i below n on the scaling threads, the calling
+ * thread included, and return once all calls are done. */
+void scalerun(void (*fn)(void *, unsigned int), void *arg, unsigned int n);
+
+/* Stop the scaling threads and release the cached filter tables. */
+void scalefree(void);
@@ -1,4 +1,8 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/ipc.h>
+#include <sys/select.h>
+#include <sys/shm.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 
@@ -11,6 +15,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <X11/keysym.h>
 #include <X11/XKBlib.h>
@@ -18,10 +23,14 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xft/Xft.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xrender.h>
 
 #include "arg.h"
 #include "util.h"
 #include "drw.h"
+#include "measure.h"
+#include "scale.h"
 
 char *argv0;
 
@@ -30,29 +39,50 @@ char *argv0;
 #define LIMIT(x, a, b) (x) = (x) < (a) ? (a) : (x) > (b) ? (b) : (x)
 #define MAXFONTSTRLEN  128
 
-typedef enum {
-	NONE = 0,
-	SCALED = 1,
-} imgstate;
-
 typedef struct {
-	unsigned char *buf;
+	uint32_t *buf;
 	unsigned int bufwidth, bufheight;
-	imgstate state;
-	XImage *ximg;
+	Pixmap scaled; /* scaled copy last drawn, owned by the cache */
+	unsigned int width, height;
+	Pixmap pm;     /* unscaled copy on the server for XRender scaling, owned by the cache */
 	int numpasses;
 } Image;
 
+/* scaled copy of an image or rendered text of a slide for one target size,
+ * kept on the server */
+typedef struct {
+	const void *key; /* the Image or Slide */
+	Pixmap *ref;     /* where the owner keeps the copy it last drew */
+	unsigned int w, h;
+	Pixmap pm;
+	Picture pic; /* XRender picture of pm, if any, freed along with it */
+	int preview; /* only scaled with nearest neighbour so far */
+	unsigned long used;
+} Scaled;
+
 typedef struct {
 	char *regex;
 	char *bin;
 } Filter;
 
+typedef struct {
+	float size;
+	Fnt *set;
+	unsigned long used;
+} Fontsize;
+
 typedef struct {
 	unsigned int linecount;
 	char **lines;
+	Txt **txt; /* lines decoded for drawing */
 	Image *img;
 	char *embed;
+	unsigned int *refw; /* line widths at the reference font size */
+	int layoutw, layouth; /* usable size the layout below was made for */
+	float size;
+	unsigned int width, height; /* of the text block */
+	int exact; /* set once width and height are measured by Xft as well */
+	Pixmap pm; /* rendered text last drawn, owned by the cache */
 } Slide;
 
 /* Purely graphic info */
@@ -65,6 +95,11 @@ typedef struct {
 	int scr;
 	int w, h;
 	int uw, uh; /* usable dimensions for drawing text and images */
+	int render; /* set if images are scaled by XRender */
+	int bpp;    /* bits per pixel of images in the default depth */
+	int shm;    /* set if images are sent through MIT-SHM */
+	XShmSegmentInfo shminfo;
+	size_t shmsize;
 } XWindow;
 
 typedef union {
@@ -86,13 +121,27 @@ typedef struct {
 	const Arg arg;
 } Shortcut;
 
+static void scachedel(const void *key);
+static void scachedelpreviews(const void *key);
+static Scaled *scacheadd(const void *key, Pixmap *ref, unsigned int w, unsigned int h);
+static Scaled *scacheget(const void *key, unsigned int w, unsigned int h);
 static void fffree(Image *img);
 static void ffload(Slide *s);
-static void ffprepare(Image *img);
-static void ffscale(Image *img);
-static void ffdraw(Image *img);
-
-static void getfontsize(Slide *s, unsigned int *width, unsigned int *height);
+static void ffprepare(Image *img, int preview);
+static void ffscale(Image *img, int preview);
+static void pmdraw(Pixmap pm, unsigned int pw, unsigned int ph, int x, int y, int w, int h);
+static XImage *ffimage(unsigned int width, unsigned int height);
+static void ffput(XImage *ximg, Drawable dst);
+static Scaled *ffupload(Image *img);
+static void ffrender(Image *img, int preview);
+
+static Fnt *getfont(float size);
+static float shrink(float size, unsigned int w, float h);
+static void layout(Slide *s);
+static void layoutslide(void *arg, unsigned int i);
+static void layoutall();
+static void xftmeasure(Slide *s);
+static void txtprepare(Slide *s);
 static void cleanup(int slidesonly);
 static void reload(const Arg *arg);
 static void load(FILE *fp);
@@ -100,10 +149,13 @@ static void advance(const Arg *arg);
 static void quit(const Arg *arg);
 static void resize(int width, int height);
 static void run();
+static long idletimeout();
+static void idle();
 static void usage();
 static void xdraw();
 static void xhints();
 static void xinit();
+static void xinitformat();
 static void xloadfonts();
 
 static void bpress(XEvent *);
@@ -123,8 +175,18 @@ static int slidecount = 0;
 static XWindow xw;
 static Drw *d = NULL;
 static Clr *sc;
-static Fnt *fonts[NUMFONTSCALES];
+static Fnt *reffont;
+static Fontsize fontsizes[NUMFONTSIZES];
+static unsigned long fonttick = 0;
 static int running = 1;
+static Scaled *scache = NULL;
+static size_t scachelen = 0;
+static size_t scachemem = 0;
+static unsigned long scachetick = 0;
+static int resizing = 0;
+static struct timespec lastresize;
+static unsigned int predrawn = 0; /* entries of predraw[] done */
+static unsigned int preloaded = 0; /* entries of preload[] done */
 
 static void (*handler[LASTEvent])(XEvent *) = {
 	[ButtonPress] = bpress,
@@ -158,12 +220,103 @@ filter(int fd, const char *cmd)
 	return fds[0];
 }
 
+static size_t
+pmsize(unsigned int w, unsigned int h)
+{
+	return (size_t)w * h * xw.bpp / 8;
+}
+
+static void
+scacheevict(size_t i)
+{
+	if (*scache[i].ref == scache[i].pm)
+		*scache[i].ref = None;
+	scachemem -= pmsize(scache[i].w, scache[i].h);
+	if (scache[i].pic)
+		XRenderFreePicture(xw.dpy, scache[i].pic);
+	XFreePixmap(xw.dpy, scache[i].pm);
+	scache[i] = scache[--scachelen];
+}
+
+void
+scachedel(const void *key)
+{
+	size_t i;
+
+	for (i = 0; i < scachelen; )
+		if (scache[i].key == key)
+			scacheevict(i);
+		else
+			i++;
+}
+
+/* Drop the previews of key, each resize step would leave one behind. */
+void
+scachedelpreviews(const void *key)
+{
+	size_t i;
+
+	for (i = 0; i < scachelen; )
+		if (scache[i].key == key && scache[i].preview)
+			scacheevict(i);
+		else
+			i++;
+}
+
+Scaled *
+scacheadd(const void *key, Pixmap *ref, unsigned int w, unsigned int h)
+{
+	size_t i, lru;
+
+	/* make room by dropping the least recently used entries, but not the
+	 * one added or used last, which may be in the middle of being drawn */
+	while (scachemem + pmsize(w, h) > scachesize) {
+		for (lru = scachelen, i = 0; i < scachelen; i++)
+			if (scache[i].used != scachetick &&
+			    (lru == scachelen || scache[i].used < scache[lru].used))
+				lru = i;
+		if (lru == scachelen)
+			break;
+		scacheevict(lru);
+	}
+
+	if (!(scache = realloc(scache, (scachelen + 1) * sizeof(*scache))))
+		die("sent: Unable to reallocate %u bytes:",
+		    (scachelen + 1) * sizeof(*scache));
+	scache[scachelen].key = key;
+	scache[scachelen].ref = ref;
+	scache[scachelen].w = w;
+	scache[scachelen].h = h;
+	scache[scachelen].pm = XCreatePixmap(xw.dpy, xw.win, w, h,
+	                                     DefaultDepth(xw.dpy, xw.scr));
+	scache[scachelen].pic = None;
+	scache[scachelen].preview = 0;
+	scache[scachelen].used = ++scachetick;
+	scachemem += pmsize(w, h);
+
+	return &scache[scachelen++];
+}
+
+Scaled *
+scacheget(const void *key, unsigned int w, unsigned int h)
+{
+	size_t i;
+
+	for (i = 0; i < scachelen; i++) {
+		if (scache[i].key == key && scache[i].w == w && scache[i].h == h) {
+			scache[i].used = ++scachetick;
+			return &scache[i];
+		}
+	}
+	return NULL;
+}
+
 void
 fffree(Image *img)
 {
+	scachedel(img);
+	scachedel(&img->pm);
 	free(img->buf);
-	if (img->ximg)
-		XDestroyImage(img->ximg);
 	free(img);
 }
 
@@ -218,17 +371,17 @@ ffload(Slide *s)
 
 	if (s->img->buf)
 		free(s->img->buf);
-	/* internally the image is stored in 888 format */
-	s->img->buf = ecalloc(s->img->bufwidth * s->img->bufheight, strlen("888"));
+	/* internally the image is stored in XRGB8888 format */
+	s->img->buf = ecalloc(s->img->bufwidth * s->img->bufheight, sizeof(uint32_t));
 
 	/* scratch buffer to read row by row */
 	rowlen = s->img->bufwidth * 2 * strlen("RGBA");
 	row = ecalloc(1, rowlen);
 
 	/* extract window background color channels for transparency */
-	bg_r = (sc[ColBg].pixel >> 16) % 256;
-	bg_g = (sc[ColBg].pixel >>  8) % 256;
-	bg_b = (sc[ColBg].pixel >>  0) % 256;
+	bg_r = sc[ColBg].color.red >> 8;
+	bg_g = sc[ColBg].color.green >> 8;
+	bg_b = sc[ColBg].color.blue >> 8;
 
 	for (off = 0, y = 0; y < s->img->bufheight; y++) {
 		nbytes = 0;
@@ -245,9 +398,10 @@ ffload(Slide *s)
 			opac = ntohs(row[x + 3]) / 257;
 			/* blend opaque part of image data with window background color to
 			 * emulate transparency */
-			s->img->buf[off++] = (fg_r * opac + bg_r * (255 - opac)) / 255;
-			s->img->buf[off++] = (fg_g * opac + bg_g * (255 - opac)) / 255;
-			s->img->buf[off++] = (fg_b * opac + bg_b * (255 - opac)) / 255;
+			s->img->buf[off++] =
+				(uint32_t)((fg_r * opac + bg_r * (255 - opac)) / 255) << 16 |
+				(uint32_t)((fg_g * opac + bg_g * (255 - opac)) / 255) << 8 |
+				(uint32_t)((fg_b * opac + bg_b * (255 - opac)) / 255);
 		}
 	}
 
@@ -255,127 +409,450 @@ ffload(Slide *s)
 	close(fdout);
 }
 
+/* Size of img scaled to fit the usable area, keeping its aspect ratio. */
+static void
+fffit(Image *img, int *width, int *height)
+{
+	*width = xw.uw;
+	*height = xw.uh;
+	if (xw.uw * img->bufheight > xw.uh * img->bufwidth)
+		*width = img->bufwidth * xw.uh / img->bufheight;
+	else
+		*height = img->bufheight * xw.uw / img->bufwidth;
+	/* never empty, it is the size of a pixmap */
+	*width = MAX(*width, 1);
+	*height = MAX(*height, 1);
+}
+
 void
-ffprepare(Image *img)
+ffprepare(Image *img, int preview)
 {
-	int depth = DefaultDepth(xw.dpy, xw.scr);
-	int width = xw.uw;
-	int height = xw.uh;
+	Scaled *s;
+	int width, height;
 
-	if (xw.uw * img->bufheight > xw.uh * img->bufwidth)
-		width = img->bufwidth * xw.uh / img->bufheight;
+	fffit(img, &width, &height);
+	img->width = width;
+	img->height = height;
+
+	/* reuse a previous scale to this size if there is one */
+	if ((s = scacheget(img, width, height)) && (!s->preview || preview)) {
+		img->scaled = s->pm;
+		return;
+	}
+	if (!s) {
+		if (preview)
+			scachedelpreviews(img);
+		s = scacheadd(img, &img->scaled, width, height);
+	}
+	img->scaled = s->pm;
+	s->preview = preview;
+	if (xw.render)
+		ffrender(img, preview);
 	else
-		height = img->bufheight * xw.uw / img->bufwidth;
+		ffscale(img, preview);
+}
 
-	if (depth < 24)
-		die("sent: Display color depths < 24 not supported");
+/* Scale img on the client and send the result to its cached pixmap. */
+void
+ffscale(Image *img, int preview)
+{
+	XImage *ximg = ffimage(img->width, img->height);
 
-	if (!(img->ximg = XCreateImage(xw.dpy, CopyFromParent, depth, ZPixmap, 0,
-	                               NULL, width, height, 32, 0)))
+	scale(img->buf, img->bufwidth, img->bufheight,
+	      (unsigned char *)ximg->data, img->width, img->height,
+	      ximg->bytes_per_line,
+	      preview ? ScaleNearest :
+	      img->width < img->bufwidth ? downscalefilter : upscalefilter);
+
+	ffput(ximg, img->scaled);
+}
+
+static int shmfailed;
+
+static int
+shmerror(Display *dpy, XErrorEvent *ev)
+{
+	shmfailed = 1;
+	return 0;
+}
+
+/* Make the shared memory segment hold at least size bytes. Returns 0 if
+ * the server cannot attach it, remote displays for example. */
+static int
+shmreserve(size_t size)
+{
+	XErrorHandler old;
+
+	if (size <= xw.shmsize)
+		return 1;
+	if (xw.shmsize) {
+		XShmDetach(xw.dpy, &xw.shminfo);
+		XSync(xw.dpy, False);
+		shmdt(xw.shminfo.shmaddr);
+		xw.shmsize = 0;
+	}
+
+	if ((xw.shminfo.shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600)) < 0)
+		return 0;
+	xw.shminfo.shmaddr = shmat(xw.shminfo.shmid, NULL, 0);
+	xw.shminfo.readOnly = False;
+	if (xw.shminfo.shmaddr == (char *)-1) {
+		shmctl(xw.shminfo.shmid, IPC_RMID, NULL);
+		return 0;
+	}
+
+	shmfailed = 0;
+	old = XSetErrorHandler(shmerror);
+	XShmAttach(xw.dpy, &xw.shminfo);
+	XSync(xw.dpy, False);
+	XSetErrorHandler(old);
+	/* gone as soon as both sides have detached */
+	shmctl(xw.shminfo.shmid, IPC_RMID, NULL);
+	if (shmfailed) {
+		shmdt(xw.shminfo.shmaddr);
+		return 0;
+	}
+	xw.shmsize = size;
+
+	return 1;
+}
+
+/* Create an image of the given size to be filled and passed to ffput(). */
+XImage *
+ffimage(unsigned int width, unsigned int height)
+{
+	int depth = DefaultDepth(xw.dpy, xw.scr);
+	XImage *ximg;
+
+	if (xw.shm) {
+		if ((ximg = XShmCreateImage(xw.dpy, xw.vis, depth, ZPixmap, NULL,
+		                            &xw.shminfo, width, height))) {
+			if (shmreserve((size_t)ximg->bytes_per_line * height)) {
+				ximg->data = xw.shminfo.shmaddr;
+				return ximg;
+			}
+			XDestroyImage(ximg);
+		}
+		/* fall back to the socket for good */
+		xw.shm = 0;
+	}
+
+	if (!(ximg = XCreateImage(xw.dpy, CopyFromParent, depth, ZPixmap, 0,
+	                          NULL, width, height, 32, 0)))
 		die("sent: Unable to create XImage");
 
-	img->ximg->data = ecalloc(height, img->ximg->bytes_per_line);
-	if (!XInitImage(img->ximg))
+	ximg->data = ecalloc(height, ximg->bytes_per_line);
+	if (!XInitImage(ximg))
 		die("sent: Unable to initiate XImage");
 
-	ffscale(img);
-	img->state |= SCALED;
+	return ximg;
 }
 
-void
-ffscale(Image *img)
+static Bool
+isshmdone(Display *dpy, XEvent *ev, XPointer arg)
 {
-	unsigned int x, y;
-	unsigned int width = img->ximg->width;
-	unsigned int height = img->ximg->height;
-	char* newBuf = img->ximg->data;
-	unsigned char* ibuf;
-	unsigned int jdy = img->ximg->bytes_per_line / 4 - width;
-	unsigned int dx = (img->bufwidth << 10) / width;
+	return ev->type == XShmGetEventBase(dpy) + ShmCompletion &&
+	       ((XShmCompletionEvent *)ev)->shmseg == xw.shminfo.shmseg;
+}
 
-	for (y = 0; y < height; y++) {
-		unsigned int bufx = img->bufwidth / width;
-		ibuf = &img->buf[y * img->bufheight / height * img->bufwidth * 3];
+/* Send ximg to dst and free it. */
+void
+ffput(XImage *ximg, Drawable dst)
+{
+	XEvent ev;
 
-		for (x = 0; x < width; x++) {
-			*newBuf++ = (ibuf[(bufx >> 10)*3+2]);
-			*newBuf++ = (ibuf[(bufx >> 10)*3+1]);
-			*newBuf++ = (ibuf[(bufx >> 10)*3+0]);
-			newBuf++;
-			bufx += dx;
-		}
-		newBuf += jdy;
+	if (ximg->obdata) {
+		XShmPutImage(xw.dpy, dst, d->gc, ximg, 0, 0, 0, 0,
+		             ximg->width, ximg->height, True);
+		/* the segment is reused, wait until the server has read it */
+		XIfEvent(xw.dpy, &ev, isshmdone, NULL);
+		ximg->data = NULL;
+	} else {
+		XPutImage(xw.dpy, dst, d->gc, ximg, 0, 0, 0, 0,
+		          ximg->width, ximg->height);
 	}
+	XDestroyImage(ximg);
 }
 
+/* Copy the part of the pw x ph pixmap centered in the window that lies
+ * inside the given window area. */
 void
-ffdraw(Image *img)
+pmdraw(Pixmap pm, unsigned int pw, unsigned int ph, int x, int y, int w, int h)
 {
-	int xoffset = (xw.w - img->ximg->width) / 2;
-	int yoffset = (xw.h - img->ximg->height) / 2;
-	XPutImage(xw.dpy, xw.win, d->gc, img->ximg, 0, 0,
-	          xoffset, yoffset, img->ximg->width, img->ximg->height);
+	int xoffset = (xw.w - (int)pw) / 2;
+	int yoffset = (xw.h - (int)ph) / 2;
+	int x0 = MAX(x, xoffset), y0 = MAX(y, yoffset);
+	int x1 = MIN(x + w, xoffset + (int)pw);
+	int y1 = MIN(y + h, yoffset + (int)ph);
+
+	if (x0 < x1 && y0 < y1)
+		XCopyArea(xw.dpy, pm, xw.win, d->gc, x0 - xoffset,
+		          y0 - yoffset, x1 - x0, y1 - y0, x0, y0);
 	XFlush(xw.dpy);
 }
 
+/* Send the unscaled image to the server, scaling happens there. Returns
+ * its cache entry. */
+Scaled *
+ffupload(Image *img)
+{
+	XImage *ximg = ffimage(img->bufwidth, img->bufheight);
+	Scaled *c;
+
+	/* scaling to the same size only converts the pixels */
+	scale(img->buf, img->bufwidth, img->bufheight,
+	      (unsigned char *)ximg->data, img->bufwidth, img->bufheight,
+	      ximg->bytes_per_line, ScaleNearest);
+	/* charged to the cache like the scaled copies and dropped the same way */
+	c = scacheadd(&img->pm, &img->pm, img->bufwidth, img->bufheight);
+	img->pm = c->pm;
+	ffput(ximg, img->pm);
+
+	c->pic = XRenderCreatePicture(xw.dpy, img->pm,
+	                              XRenderFindVisualFormat(xw.dpy, xw.vis),
+	                              0, NULL);
+	return c;
+}
+
+/* Let the server scale img into its cached pixmap. */
 void
-getfontsize(Slide *s, unsigned int *width, unsigned int *height)
+ffrender(Image *img, int preview)
 {
-	int i, j;
-	unsigned int curw, newmax;
-	float lfac = linespacing * (s->linecount - 1) + 1;
+	XTransform t = {{
+		{ XDoubleToFixed(1), 0, 0 },
+		{ 0, XDoubleToFixed(1), 0 },
+		{ 0, 0, XDoubleToFixed(1) },
+	}};
+	Picture dst, src;
+	Scaled *c;
+
+	/* upload the image again if the cache dropped it */
+	if (!(c = scacheget(&img->pm, img->bufwidth, img->bufheight)))
+		c = ffupload(img);
+	src = c->pic;
+
+	/* the transform maps destination to image coordinates */
+	t.matrix[0][0] = XDoubleToFixed((double)img->bufwidth / img->width);
+	t.matrix[1][1] = XDoubleToFixed((double)img->bufheight / img->height);
+	XRenderSetPictureTransform(xw.dpy, src, &t);
+	XRenderSetPictureFilter(xw.dpy, src,
+	                        preview ? FilterFast : FilterBest, NULL, 0);
+
+	dst = XRenderCreatePicture(xw.dpy, img->scaled,
+	                           XRenderFindVisualFormat(xw.dpy, xw.vis),
+	                           0, NULL);
+	XRenderComposite(xw.dpy, PictOpSrc, src, None, dst, 0, 0, 0, 0,
+	                 0, 0, img->width, img->height);
+	XRenderFreePicture(xw.dpy, dst);
+}
 
-	/* fit height */
-	for (j = NUMFONTSCALES - 1; j >= 0; j--)
-		if (fonts[j]->h * lfac <= xw.uh)
-			break;
-	LIMIT(j, 0, NUMFONTSCALES - 1);
-	drw_setfontset(d, fonts[j]);
-
-	/* fit width */
-	*width = 0;
-	for (i = 0; i < s->linecount; i++) {
-		curw = drw_fontset_getwidth(d, s->lines[i]);
-		newmax = (curw >= *width);
-		while (j > 0 && curw > xw.uw) {
-			drw_setfontset(d, fonts[--j]);
-			curw = drw_fontset_getwidth(d, s->lines[i]);
+/* Font set for size, the least recently used other size is closed if
+ * too many are open. */
+Fnt *
+getfont(float size)
+{
+	int i, lru = 0;
+
+	if (size == reffontsize)
+		return reffont;
+	for (i = 0; i < NUMFONTSIZES; i++) {
+		if (fontsizes[i].set && fontsizes[i].size == size) {
+			fontsizes[i].used = ++fonttick;
+			return fontsizes[i].set;
 		}
-		if (newmax)
-			*width = curw;
+		if (fontsizes[i].used < fontsizes[lru].used)
+			lru = i;
+	}
+
+	drw_fontset_free(fontsizes[lru].set);
+	if (!(fontsizes[lru].set = drw_fontset_scale(d, reffont, size)))
+		die("sent: Unable to load any font for size %g", size);
+	fontsizes[lru].size = size;
+	fontsizes[lru].used = ++fonttick;
+	return fontsizes[lru].set;
+}
+
+/* Next size to try for text measuring w x h at size, too large for the
+ * usable area. */
+float
+shrink(float size, unsigned int w, float h)
+{
+	float r = MIN(w > xw.uw ? (float)xw.uw / w : 1, h > xw.uh ? xw.uh / h : 1);
+
+	return MIN(size * r, size - 0.25);
+}
+
+/* Fit the text of s to the usable area, unless it already is. Text is
+ * measured with FreeType only, so several slides may be laid out at once
+ * on different threads after their text has been segmented. */
+void
+layout(Slide *s)
+{
+	unsigned int i, w, h;
+	float size, lfac = linespacing * (s->linecount - 1) + 1;
+
+	if (s->layoutw == xw.uw && s->layouth == xw.uh)
+		return;
+
+	/* text is measured at one size only, the others are derived from it */
+	if (!s->refw) {
+		s->refw = ecalloc(s->linecount, sizeof(*s->refw));
+		for (i = 0; i < s->linecount; i++)
+			s->refw[i] = drw_fontset_measure(d, reffont, reffontsize, s->txt[i]);
+	}
+	for (w = 0, i = 0; i < s->linecount; i++)
+		w = MAX(w, s->refw[i]);
+	size = reffontsize * xw.uh / (reffont->h * lfac);
+	if (w)
+		size = MIN(size, reffontsize * xw.uw / w);
+
+	/* hinting keeps widths from being quite proportional to the size,
+	 * check the result and shrink by what is still missing */
+	while (1) {
+		size = floorf(size * 4) / 4;
+		LIMIT(size, minfontsize, maxfontsize);
+		h = drw_fontset_measureheight(reffont, size);
+		for (w = 0, i = 0; i < s->linecount; i++)
+			w = MAX(w, drw_fontset_measure(d, reffont, size, s->txt[i]));
+		if (size <= minfontsize || (w <= xw.uw && h * lfac <= xw.uh))
+			break;
+		size = shrink(size, w, h * lfac);
 	}
-	*height = fonts[j]->h * lfac;
+
+	s->size = size;
+	/* never empty, it is the size of a pixmap */
+	s->width = MAX(w, 1);
+	s->height = MAX(h * lfac, 1);
+	s->layoutw = xw.uw;
+	s->layouth = xw.uh;
+	s->exact = 0;
 }
 
+static void
+layoutslide(void *arg, unsigned int i)
+{
+	if (!slides[i].img)
+		layout(&slides[i]);
+}
+
+/* Lay out all text slides at once on the scaling threads. */
 void
-cleanup(int slidesonly)
+layoutall()
 {
 	unsigned int i, j;
 
-	if (!slidesonly) {
-		for (i = 0; i < NUMFONTSCALES; i++)
-			drw_fontset_free(fonts[i]);
-		free(sc);
-		drw_free(d);
+	/* finding the fonts of the text asks the X server, do it up front */
+	for (i = 0; i < slidecount; i++)
+		for (j = 0; j < slides[i].linecount && !slides[i].img; j++)
+			drw_txt_segment(d, slides[i].txt[j]);
+	scalerun(layoutslide, NULL, slidecount);
+}
 
-		XDestroyWindow(xw.dpy, xw.win);
-		XSync(xw.dpy, False);
-		XCloseDisplay(xw.dpy);
+/* Measure the laid out text of s again with Xft, which draws it, and
+ * shrink it further should the two disagree. This loads its glyphs too. */
+void
+xftmeasure(Slide *s)
+{
+	unsigned int i, w;
+	float size = s->size, lfac = linespacing * (s->linecount - 1) + 1;
+	Fnt *f;
+
+	if (s->exact)
+		return;
+	while (1) {
+		drw_setfontset(d, (f = getfont(size)));
+		for (w = 0, i = 0; i < s->linecount; i++)
+			w = MAX(w, drw_fontset_getwidth(d, s->txt[i]));
+		if (size <= minfontsize || (w <= xw.uw && f->h * lfac <= xw.uh))
+			break;
+		size = floorf(shrink(size, w, f->h * lfac) * 4) / 4;
+		size = MAX(size, minfontsize);
+	}
+	s->size = size;
+	s->width = MAX(w, 1);
+	s->height = MAX(f->h * lfac, 1);
+	s->exact = 1;
+	/* text rendered for the old layout is of no use anymore */
+	scachedel(s);
+}
+
+/* Render the text of s into its cached pixmap, unless it already is. */
+void
+txtprepare(Slide *s)
+{
+	Scaled *c;
+	Drawable prev;
+	unsigned int i;
+
+	layout(s);
+	xftmeasure(s);
+	if ((c = scacheget(s, s->width, s->height))) {
+		s->pm = c->pm;
+		return;
 	}
+	s->pm = scacheadd(s, &s->pm, s->width, s->height)->pm;
+
+	/* straight into the pixmap, the block may well be larger than the
+	 * window when the text is still too wide at the smallest size */
+	prev = drw_settarget(d, s->pm);
+	drw_setfontset(d, getfont(s->size));
+	drw_rect(d, 0, 0, s->width, s->height, 1, 1);
+	for (i = 0; i < s->linecount; i++)
+		drw_text(d,
+		         0,
+		         i * linespacing * d->fonts->h,
+		         s->width,
+		         d->fonts->h,
+		         0,
+		         s->txt[i],
+		         0);
+	drw_settarget(d, prev);
+}
+
+void
+cleanup(int slidesonly)
+{
+	unsigned int i, j;
 
 	if (slides) {
 		for (i = 0; i < slidecount; i++) {
-			for (j = 0; j < slides[i].linecount; j++)
+			for (j = 0; j < slides[i].linecount; j++) {
 				free(slides[i].lines[j]);
+				drw_txt_free(slides[i].txt[j]);
+			}
 			free(slides[i].lines);
+			free(slides[i].txt);
+			free(slides[i].refw);
 			if (slides[i].img)
 				fffree(slides[i].img);
+			scachedel(&slides[i]);
 		}
 		if (!slidesonly) {
 			free(slides);
 			slides = NULL;
+			free(scache);
+			scache = NULL;
 		}
 	}
+
+	if (!slidesonly) {
+		for (i = 0; i < NUMFONTSIZES; i++)
+			drw_fontset_free(fontsizes[i].set);
+		drw_fontset_free(reffont);
+		free(sc);
+		drw_free(d);
+		scalefree();
+		measurefree();
+		if (xw.shmsize) {
+			XShmDetach(xw.dpy, &xw.shminfo);
+			XSync(xw.dpy, False);
+			shmdt(xw.shminfo.shmaddr);
+		}
+
+		XDestroyWindow(xw.dpy, xw.win);
+		XSync(xw.dpy, False);
+		XCloseDisplay(xw.dpy);
+	}
 }
 
 void
@@ -400,6 +877,7 @@ reload(const Arg *arg)
 	LIMIT(idx, 0, slidecount-1);
 	for (i = 0; i < slidecount; i++)
 		ffload(&slides[i]);
+	layoutall();
 	xdraw();
 }
 
@@ -407,7 +885,7 @@ void
 load(FILE *fp)
 {
 	static size_t size = 0;
-	size_t blen, maxlines;
+	size_t blen, maxlines, i;
 	char buf[BUFSIZ], *p;
 	Slide *s;
 
@@ -453,6 +931,11 @@ load(FILE *fp)
 			s->linecount++;
 		} while ((p = fgets(buf, sizeof(buf), fp)) && strcmp(buf, "\n") != 0);
 
+		/* decode once instead of on every measurement and redraw */
+		s->txt = ecalloc(s->linecount, sizeof(*s->txt));
+		for (i = 0; i < s->linecount; i++)
+			s->txt[i] = drw_txt_create(s->lines[i]);
+
 		slidecount++;
 		if (!p)
 			break;
@@ -468,8 +951,6 @@ advance(const Arg *arg)
 	int new_idx = idx + arg->i;
 	LIMIT(new_idx, 0, slidecount-1);
 	if (new_idx != idx) {
-		if (slides[idx].img)
-			slides[idx].img->state &= ~SCALED;
 		idx = new_idx;
 		xdraw();
 	}
@@ -488,13 +969,16 @@ resize(int width, int height)
 	xw.h = height;
 	xw.uw = usablewidth * width;
 	xw.uh = usableheight * height;
-	drw_resize(d, width, height);
 }
 
 void
 run()
 {
 	XEvent ev;
+	fd_set fds;
+	struct timeval tv;
+	long timeout;
+	int xfd = ConnectionNumber(xw.dpy);
 
 	/* Waiting for window mapping */
 	while (1) {
@@ -505,40 +989,102 @@ run()
 			break;
 		}
 	}
+	layoutall();
 
 	while (running) {
+		/* with deferred work pending only wait for events until it is due */
+		if (!XPending(xw.dpy) && (timeout = idletimeout()) >= 0) {
+			FD_ZERO(&fds);
+			FD_SET(xfd, &fds);
+			tv.tv_sec = timeout / 1000;
+			tv.tv_usec = timeout % 1000 * 1000;
+			if (select(xfd + 1, &fds, NULL, NULL, &tv) <= 0) {
+				idle();
+				continue;
+			}
+		}
 		XNextEvent(xw.dpy, &ev);
 		if (handler[ev.type])
 			(handler[ev.type])(&ev);
 	}
 }
 
+static long
+msecsince(struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* Return in how many milliseconds idle() has work to do, or -1 if it has
+ * none. */
+long
+idletimeout()
+{
+	if (resizing)
+		return MAX(resizeidle - msecsince(&lastresize), 0);
+	if (predrawn < LEN(predraw) || preloaded < LEN(preload))
+		return 0;
+	return -1;
+}
+
+void
+idle()
+{
+	int i;
+
+	if (resizing) {
+		/* the window has settled, redo previews in full quality */
+		if (msecsince(&lastresize) >= resizeidle) {
+			resizing = 0;
+			if (slides[idx].img)
+				xdraw();
+		}
+		return;
+	}
+
+	/* prepare one neighbouring slide per call so events are not held up */
+	if (predrawn < LEN(predraw)) {
+		i = idx + predraw[predrawn++];
+		if (i >= 0 && i < slidecount) {
+			if (slides[i].img)
+				ffprepare(slides[i].img, 0);
+			else
+				txtprepare(&slides[i]);
+			XFlush(xw.dpy);
+		}
+	} else if (preloaded < LEN(preload)) {
+		/* measuring at the fitted size with Xft rasterizes the glyphs, so
+		 * the big ones are not rendered only when the slide is shown */
+		i = idx + preload[preloaded++];
+		if (i >= 0 && i < slidecount && !slides[i].img) {
+			layout(&slides[i]);
+			xftmeasure(&slides[i]);
+			XFlush(xw.dpy);
+		}
+	}
+}
+
 void
 xdraw()
 {
-	unsigned int height, width, i;
-	Image *im = slides[idx].img;
+	Slide *s = &slides[idx];
+	Image *im = s->img;
 
-	getfontsize(&slides[idx], &width, &height);
 	XClearWindow(xw.dpy, xw.win);
 
 	if (!im) {
-		drw_rect(d, 0, 0, xw.w, xw.h, 1, 1);
-		for (i = 0; i < slides[idx].linecount; i++)
-			drw_text(d,
-			         (xw.w - width) / 2,
-			         (xw.h - height) / 2 + i * linespacing * d->fonts->h,
-			         width,
-			         d->fonts->h,
-			         0,
-			         slides[idx].lines[i],
-			         0);
-		drw_map(d, xw.win, 0, 0, xw.w, xw.h);
+		txtprepare(s);
+		pmdraw(s->pm, s->width, s->height, 0, 0, xw.w, xw.h);
 	} else {
-		if (!(im->state & SCALED))
-			ffprepare(im);
-		ffdraw(im);
+		ffprepare(im, resizing);
+		pmdraw(im->scaled, im->width, im->height, 0, 0, xw.w, xw.h);
 	}
+
+	/* start over for the new slide or size, earlier work stays cached */
+	predrawn = preloaded = 0;
 }
 
 void
@@ -564,11 +1110,13 @@ xinit()
 {
 	XTextProperty prop;
 	unsigned int i;
+	int evbase, errbase;
 
 	if (!(xw.dpy = XOpenDisplay(NULL)))
 		die("sent: Unable to open display");
 	xw.scr = XDefaultScreen(xw.dpy);
 	xw.vis = XDefaultVisual(xw.dpy, xw.scr);
+	xinitformat();
 	resize(DisplayWidth(xw.dpy, xw.scr), DisplayHeight(xw.dpy, xw.scr));
 
 	xw.attrs.bit_gravity = CenterGravity;
@@ -584,13 +1132,19 @@ xinit()
 	xw.netwmname = XInternAtom(xw.dpy, "_NET_WM_NAME", False);
 	XSetWMProtocols(xw.dpy, xw.win, &xw.wmdeletewin, 1);
 
-	if (!(d = drw_create(xw.dpy, xw.scr, xw.win, xw.w, xw.h)))
+	/* text is drawn into the pixmaps of the slides, the drawable of d
+	 * only stands in until drw_settarget() points it at one */
+	if (!(d = drw_create(xw.dpy, xw.scr, xw.win, 1, 1)))
 		die("sent: Unable to create drawing context");
 	sc = drw_scm_create(d, colors, 2);
 	drw_setscheme(d, sc);
 	XSetWindowBackground(xw.dpy, xw.win, sc[ColBg].pixel);
 
+	xw.render = serverscale && XRenderQueryExtension(xw.dpy, &evbase, &errbase);
+	xw.shm = XShmQueryExtension(xw.dpy);
+
 	xloadfonts();
+	scaleinit(scalethreads);
 	for (i = 0; i < slidecount; i++)
 		ffload(&slides[i]);
 
@@ -603,28 +1157,49 @@ xinit()
 	XSync(xw.dpy, False);
 }
 
+/* Pick the pixel converter for images in the default visual. */
+void
+xinitformat()
+{
+	XPixmapFormatValues *fmts;
+	int i, n, depth = DefaultDepth(xw.dpy, xw.scr);
+
+	if (xw.vis->class != TrueColor && xw.vis->class != DirectColor)
+		die("sent: Only TrueColor and DirectColor visuals are supported");
+
+	xw.bpp = 0;
+	if ((fmts = XListPixmapFormats(xw.dpy, &n))) {
+		for (i = 0; i < n; i++)
+			if (fmts[i].depth == depth)
+				xw.bpp = fmts[i].bits_per_pixel;
+		XFree(fmts);
+	}
+	if (xw.bpp != 16 && xw.bpp != 24 && xw.bpp != 32)
+		die("sent: Unsupported image format with %d bits per pixel", xw.bpp);
+
+	convfind(xw.vis->red_mask, xw.vis->green_mask, xw.vis->blue_mask,
+	         xw.bpp, ImageByteOrder(xw.dpy) == MSBFirst);
+}
+
+/* Only the reference size is matched by name, the others are derived from
+ * it on demand by getfont(). */
 void
 xloadfonts()
 {
-	int i, j;
+	int j;
 	char *fstrs[LEN(fontfallbacks)];
 
 	for (j = 0; j < LEN(fontfallbacks); j++) {
 		fstrs[j] = ecalloc(1, MAXFONTSTRLEN);
+		if (MAXFONTSTRLEN < snprintf(fstrs[j], MAXFONTSTRLEN, "%s:size=%g", fontfallbacks[j], reffontsize))
+			die("sent: Font string too long");
 	}
 
-	for (i = 0; i < NUMFONTSCALES; i++) {
-		for (j = 0; j < LEN(fontfallbacks); j++) {
-			if (MAXFONTSTRLEN < snprintf(fstrs[j], MAXFONTSTRLEN, "%s:size=%d", fontfallbacks[j], FONTSZ(i)))
-				die("sent: Font string too long");
-		}
-		if (!(fonts[i] = drw_fontset_create(d, (const char**)fstrs, LEN(fstrs))))
-			die("sent: Unable to load any font for size %d", FONTSZ(i));
-	}
+	if (!(reffont = drw_fontset_create(d, (const char**)fstrs, LEN(fstrs))))
+		die("sent: Unable to load any font for size %g", reffontsize);
 
 	for (j = 0; j < LEN(fontfallbacks); j++)
-		if (fstrs[j])
-			free(fstrs[j]);
+		free(fstrs[j]);
 }
 
 void
@@ -647,8 +1222,19 @@ cmessage(XEvent *e)
 void
 expose(XEvent *e)
 {
-	if (0 == e->xexpose.count)
-		xdraw();
+	Slide *s = &slides[idx];
+	Image *im = s->img;
+
+	/* only the uncovered part is copied from the slide's pixmap */
+	if (im) {
+		ffprepare(im, resizing);
+		pmdraw(im->scaled, im->width, im->height, e->xexpose.x,
+		       e->xexpose.y, e->xexpose.width, e->xexpose.height);
+	} else {
+		txtprepare(s);
+		pmdraw(s->pm, s->width, s->height, e->xexpose.x,
+		       e->xexpose.y, e->xexpose.width, e->xexpose.height);
+	}
 }
 
 void
@@ -666,9 +1252,15 @@ kpress(XEvent *e)
 void
 configure(XEvent *e)
 {
+	/* only the latest of a burst of resizes matters */
+	while (XCheckTypedWindowEvent(xw.dpy, xw.win, ConfigureNotify, e))
+		;
+	if (e->xconfigure.width == xw.w && e->xconfigure.height == xw.h)
+		return;
+
+	resizing = 1;
+	clock_gettime(CLOCK_MONOTONIC, &lastresize);
 	resize(e->xconfigure.width, e->xconfigure.height);
-	if (slides[idx].img)
-		slides[idx].img->state &= ~SCALED;
 	xdraw();
 }
 